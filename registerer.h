@@ -14,6 +14,8 @@
 //    from different parameters.
 //  - builtin mechanism to override registered classes, making dependency
 //    injection e.g. for tests very easy.
+//  - lookups take no lock once registration is finished, so instances
+//    can be created concurrently from many threads.
 //
 // Basic usage
 // -----------
@@ -58,6 +60,14 @@
 // If no class is registered, it will return a null unique_ptr<>.
 // The CanNew() predicate can be used to check if New() would succeed without
 // actually creating an instance.
+// TryNew() does both with a single lookup, telling apart a missing key from
+// a factory returning null.
+//
+// Keys can be passed as std::string, C strings or KeyView, the latter
+// referencing any slice of characters without copying it. Literal keys can
+// be wrapped in REGISTRY_KEY(), which hashes them at compile time:
+//
+//    Registry<Shape>::New(REGISTRY_KEY("Rect"));
 //
 // Advanced usage
 // --------------
@@ -78,23 +88,30 @@
 // The class can be instantiated using Registry<> with extra parameters
 // matching the constructor signature:
 //
-//  auto shape = Registry<Shape, const string&>::New("Ellipsis");
+//  auto shape = Registry<Shape, const string&>::New("Ellipsis", "round");
 //  shape->Draw();  // will draw a circle!
 //
+// Parameters are forwarded to the constructor, so that arguments taken by
+// value are moved from rvalues, and can be move-only types:
+//
+//  Registry<Vehicle, std::unique_ptr<Engine>>::New("Car", std::move(engine));
+//
 // One very interesting benefit of this approach is that client code can
 // extend the supported types without editing the base class or
 // any of the existing registered classes. The code below simply test
 // if a class can be instantiated with a parameter, and otherwise
-// tries to instantiate without parameters:
+// tries to instantiate without parameters, with a single lookup for
+// each signature:
 //
 //   int main(int argc, char **argv) {
 //     for (int i = 1; i + 1 < argc; i += 2) {
 //       const std::string key = argv[i];
 //       const std::string params = argv[i + 1];
-//       if (Registry<Shape, const std::string &>::CanNew(key, params)) {
-//         Registry<Shape, const std::string &>::New(key, params)->Draw();
-//       } else if (Registry<Shape>::CanNew(key)) {
-//         Registry<Shape>::New(key)->Draw();
+//       std::unique_ptr<Shape> shape;
+//       if (TryNewAny(key, &shape,
+//                     Registry<Shape, const std::string &>::With(params),
+//                     Registry<Shape>::With())) {
+//         shape->Draw();
 //       }
 //     }
 //   }
@@ -166,12 +183,113 @@
 // extend the framework to support it though, by storing `type_info`
 // objects in the registry.
 //
+// When the class is known at compile time but may be replaced by an
+// injector, as in tests, the following code:
+//
+//   Registry<Shape>::NewStatic<Circle>()
+//
+// is equivalent to Registry<Shape>::New("Circle"), but directly creates
+// a Circle with no lookup while no injector is alive.
+//
 // The Registry<> class can also be used to list all keys that are
 // registered, along with the filename and line number at which the
 // registration is defined. It does not list though the type associated
 // to the key. Here again, it is pretty easy to extend the framework
 // to provide such functionality using type_info objects.
 //
+// When many objects are created for the same key, the key can be
+// resolved once into a handle instantiating objects without any lookup:
+//
+//   auto factory = Registry<Shape>::Resolve("Circle");
+//   for (int i = 0; i < 1000; ++i) {
+//     factory.New()->Draw();
+//   }
+//
+// The handle does not follow injectors created after it was resolved.
+// Its IsStale() and Refresh() methods can be used to detect and pick up
+// such changes.
+//
+// Keys read from a configuration can be resolved together with ResolveAll(),
+// which returns a null handle for each missing key:
+//
+//   auto factories = Registry<Shape>::ResolveAll(config_keys);
+//
+// Objects can be allocated from a std::pmr::memory_resource, or from
+// any class with the same allocate() and deallocate() methods, instead
+// of the heap:
+//
+//   std::pmr::monotonic_buffer_resource arena;
+//   auto shape = Registry<Shape>::NewIn(&arena, "Rect");  // A ResourcePtr.
+//
+// The size and alignment of the class registered for a key are available
+// without creating an instance, to size pools or buffers ahead:
+//
+//   const auto *info = Registry<Shape>::GetClassInfo("Rect");
+//   if (info && info->size <= kBufferSize) { ... }
+//
+// Objects can also be constructed in a buffer, e.g. an element of an array
+// or a ring buffer, which fails if the buffer is too small or misaligned:
+//
+//   Shape *shape = Registry<Shape>::NewAt(buffer, sizeof(buffer), "Rect");
+//   ...
+//   shape->~Shape();
+//
+// Small objects can be kept inside a holder instead of on the heap. The
+// holder below stores the object inline if its class fits in 64 bytes:
+//
+//   Registry<Shape>::Inline<64> shape = Registry<Shape>::NewInline<64>("Rect");
+//
+// Short-lived objects created over and over with the same key can recycle
+// their memory through a pool kept for each key:
+//
+//   auto shape = Registry<Shape>::Pooled("Rect");  // A PooledPtr.
+//
+// Classes that are immutable once constructed, e.g. stateless strategies,
+// can be constructed once per key and shared by all callers, until
+// EvictShared() drops the instance:
+//
+//   std::shared_ptr<const Shape> shape = Registry<Shape>::GetShared("Rect");
+//
+// Objects meant to be owned by std::shared_ptr<> can be allocated along with
+// their control block, from the heap or from a resource as with NewIn():
+//
+//   std::shared_ptr<Shape> shape = Registry<Shape>::NewShared("Rect");
+//   auto other = Registry<Shape>::NewSharedIn(&arena, "Rect");
+//
+// Many objects of the same class can be created at once, looking up the key
+// only once, either each on the heap or all in a single block of memory:
+//
+//   auto shapes = Registry<Shape>::NewMany("Rect", 1000);  // unique_ptr<>s.
+//   auto slab = Registry<Shape>::NewSlab("Rect", 1000);
+//   for (Shape *shape : slab) { ... }
+//
+// Lookups use a hash table. Once all classes are registered, e.g. at the
+// beginning of main(), the table of a registry can be turned into a
+// minimal perfect hash by calling:
+//
+//   Registry<Shape>::Freeze();
+//
+// Lookups take no lock: they read a snapshot of the registry, rebuilt after
+// each registration or injection. Registries whose injectors change often
+// can instead use a reader-writer lock or mutexes over shards of keys, by
+// specializing LockingPolicy<> before registering any class:
+//
+//   namespace factory {
+//   template <> struct LockingPolicy<Shape> {
+//     typedef ShardedLocking<16> type;  // Or ReaderWriterLocking.
+//   };
+//   }
+//
+// With either of them, CachedLocking<> adds a cache of the entries found by
+// each thread, so that threads looking up a few hot keys take no lock:
+//
+//     typedef CachedLocking<ReaderWriterLocking> type;
+//
+// With any policy, FilteredLocking<> adds a filter rejecting most unknown
+// keys without any lock, for registries mostly probed with unknown keys:
+//
+//     typedef FilteredLocking<ReaderWriterLocking> type;
+//
 // Even though not necessary, one can define intermediate macros to
 // reduce boilerplate code even more. For the Shape example above,
 // one could define:
@@ -199,17 +317,42 @@
 //
 // None of the static methods of Registry<> can be called from
 // a global static, as it would result in an initialization order fiasco.
+//
+// On ELF platforms, this can be avoided by defining REGISTERER_USE_SECTIONS
+// for the whole program, e.g. with the REGISTERER_SECTIONS option of CMake.
+// REGISTER() then emits a constant record into a section of the binary
+// instead of registering the class during static initialization, and each
+// registry indexes all its records at once when first used. This removes
+// the cost of REGISTER() at startup and lets global statics look up classes,
+// though not injectors. In this mode, REGISTER() can not be used in class
+// templates, and classes are only known to registries used from the same
+// executable or shared library.
 
 #ifndef REGISTERER_H
 #define REGISTERER_H
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <string>
-#include <map>
+#include <thread>
+#include <tuple>
 #include <functional>
+#include <initializer_list>
+#include <iterator>
 #include <type_traits>
+#include <utility>
 #include <vector>
+#if __cplusplus >= 201703L
+#include <shared_mutex>
+#include <string_view>
+#endif
 
 // Main macro. See file documentation for usage.
 #define REGISTER(KEY, TYPE, ARGS...) REGISTER_AT(__LINE__, KEY, TYPE, ##ARGS)
@@ -225,184 +368,2499 @@
   }, __FILE__, STRINGIFY(LINE));                                               \
   static_assert(true, "") // enforce ; at EOL
 
+// KeyView of a string literal whose length and hash are computed at compile
+// time, so that looking it up does not hash it.
+#define REGISTRY_KEY(LITERAL)                                                  \
+  ::factory::KeyView(                                                          \
+      LITERAL, sizeof(LITERAL) - 1,                                            \
+      ::factory::ConstantHash< ::factory::ConstexprHashKey(                    \
+          LITERAL, sizeof(LITERAL) - 1)>::value)
+
 namespace factory {
-template <typename T, class... Args> class Registry {
+// Non-owning reference to a key, used by lookup functions so that keys
+// held as C strings or as slices of a larger buffer do not need to be
+// copied into a std::string. This is a C++11 stand-in for string_view,
+// to which it also converts implicitly when compiled as C++17.
+class KeyView {
 public:
-  // Return 'true' if there is a class registered for `key` for
-  // a constructor with signature (Args... args).
-  //
-  // This function can not be called from any static initializer
-  // or it creates initializer order fiasco.
-  static bool CanNew(const std::string &key, Args... args) {
-    return GetEntry(key, args...).first;
+  KeyView(const char *data)
+      : data_(data), size_(std::strlen(data)), hash_(0), hashed_(false) {}
+  constexpr KeyView(const char *data, std::size_t size)
+      : data_(data), size_(size), hash_(0), hashed_(false) {}
+  // Key whose hash is already known, as built by REGISTRY_KEY(). `hash`
+  // must be what the registry computes for the key.
+  constexpr KeyView(const char *data, std::size_t size, std::uint64_t hash)
+      : data_(data), size_(size), hash_(hash), hashed_(true) {}
+  KeyView(const std::string &key)
+      : data_(key.data()), size_(key.size()), hash_(0), hashed_(false) {}
+#if __cplusplus >= 201703L
+  KeyView(std::string_view key)
+      : data_(key.data()), size_(key.size()), hash_(0), hashed_(false) {}
+#endif
+
+  constexpr const char *data() const { return data_; }
+  constexpr std::size_t size() const { return size_; }
+  constexpr bool has_hash() const { return hashed_; }
+  constexpr std::uint64_t hash() const { return hash_; }
+  std::string ToString() const { return std::string(data_, size_); }
+
+  int compare(const KeyView &other) const {
+    const int result =
+        std::memcmp(data_, other.data_, std::min(size_, other.size_));
+    if (result != 0) {
+      return result;
+    }
+    return size_ < other.size_ ? -1 : (size_ > other.size_ ? 1 : 0);
   }
+  bool operator==(const KeyView &other) const {
+    return size_ == other.size_ && std::memcmp(data_, other.data_, size_) == 0;
+  }
+  bool operator<(const KeyView &other) const { return compare(other) < 0; }
 
-  // If there is a class registered for `key` for a constructor
-  // with signature (Args... args), instantiate an object of that class
-  // passing args to the constructor. Returns a null pointer otherwise.
-  //
-  // This function can not be called from any static initializer
-  // or it creates initializer order fiasco.
-  static std::unique_ptr<T> New(const std::string &key, Args... args) {
-    std::unique_ptr<T> result;
-    auto entry = GetEntry(key, args...);
-    if (entry.first) {
-      result.reset(entry.second->function(args...));
+private:
+  const char *data_;
+  std::size_t size_;
+  std::uint64_t hash_;
+  bool hashed_;
+};
+
+// Allocator taking its memory from a resource with the allocate() and
+// deallocate() methods of std::pmr::memory_resource, whose type is erased
+// so that any resource can be passed to code compiled ahead, such as the
+// functions generated by REGISTER(). The resource must outlive the memory
+// allocated from it.
+template <typename U> class ResourceAllocator {
+public:
+  typedef U value_type;
+  template <typename V> struct rebind { typedef ResourceAllocator<V> other; };
+
+  template <typename Resource>
+  explicit ResourceAllocator(Resource *resource)
+      : resource_(resource), allocate_(&Allocate<Resource>),
+        deallocate_(&Deallocate<Resource>) {}
+  template <typename V>
+  ResourceAllocator(const ResourceAllocator<V> &other)
+      : resource_(other.resource_), allocate_(other.allocate_),
+        deallocate_(other.deallocate_) {}
+
+  U *allocate(std::size_t n) {
+    void *block = allocate_(resource_, n * sizeof(U),
+                            std::alignment_of<U>::value);
+    if (!block) {
+      throw std::bad_alloc();
+    }
+    return static_cast<U *>(block);
+  }
+  void deallocate(U *block, std::size_t n) {
+    deallocate_(resource_, block, n * sizeof(U), std::alignment_of<U>::value);
+  }
+  // Like allocate() and deallocate(), for blocks of any size and alignment.
+  void *allocate_bytes(std::size_t size, std::size_t alignment) {
+    void *block = allocate_(resource_, size, alignment);
+    if (!block) {
+      throw std::bad_alloc();
     }
-    registry_mutex_.unlock();
-    return std::move(result);
+    return block;
+  }
+  void deallocate_bytes(void *block, std::size_t size, std::size_t alignment) {
+    deallocate_(resource_, block, size, alignment);
   }
 
-  // Return the key under which class `C` is registered. The header
-  // defining that class must be included by code calling this
-  // function. If class is not registered, there will be a compile-
-  // time failure.
-  template <typename C> static const char *GetKeyFor() {
-    return C::_xd_key(static_cast<const T *>(nullptr),
-                      std::function<void(Args...)>());
+  template <typename V>
+  bool operator==(const ResourceAllocator<V> &other) const {
+    return resource_ == other.resource_;
+  }
+  template <typename V>
+  bool operator!=(const ResourceAllocator<V> &other) const {
+    return resource_ != other.resource_;
   }
 
-  // Returns the list of keys registered for the registry.
-  // Keys corresponding to injectors (see below) are suffixed with
-  // a star.
-  //
-  // This function can not be called from any static initializer
-  // or it creates initializer order fiasco.
-  static std::vector<std::string> GetKeys() {
-    std::vector<std::string> keys;
-    registry_mutex_.lock();
-    for (const auto &iter : *GetRegistry()) {
-      keys.emplace_back(iter.first);
+private:
+  template <typename V> friend class ResourceAllocator;
+  template <typename Resource>
+  static void *Allocate(void *resource, std::size_t size,
+                        std::size_t alignment) {
+    return static_cast<Resource *>(resource)->allocate(size, alignment);
+  }
+  template <typename Resource>
+  static void Deallocate(void *resource, void *block, std::size_t size,
+                         std::size_t alignment) {
+    static_cast<Resource *>(resource)->deallocate(block, size, alignment);
+  }
+
+  void *resource_;
+  void *(*allocate_)(void *, std::size_t, std::size_t);
+  void (*deallocate_)(void *, void *, std::size_t, std::size_t);
+};
+
+// Resource allocating from the heap, for blocks aligned at most like
+// std::max_align_t.
+struct HeapResource {
+  void *allocate(std::size_t size, std::size_t) {
+    return ::operator new(size);
+  }
+  void deallocate(void *block, std::size_t, std::size_t) {
+    ::operator delete(block);
+  }
+};
+
+// Locking policies of Registry<>, i.e. how lookups synchronize with the
+// creation and destruction of registerers and injectors.
+//
+// Lookups read an immutable snapshot of the registry without taking any
+// lock. The snapshot is rebuilt by the first lookup after each change.
+struct SnapshotLocking {};
+// Lookups share a reader-writer lock, which changes take exclusively.
+struct ReaderWriterLocking {};
+// Keys are spread by hash over N shards, each with its own mutex, so that
+// lookups only contend with lookups of keys in the same shard.
+template <std::size_t N> struct ShardedLocking {
+  static_assert(N > 0, "ShardedLocking<> needs at least one shard");
+};
+// Adds to `Policy` a cache in each thread of the last entries found for
+// `Slots` hashes of keys. A cache hit takes no lock and writes no shared
+// memory. The cache is dropped whenever a registerer or an injector is
+// created or destroyed.
+template <typename Policy, std::size_t Slots = 16> struct CachedLocking {
+  static_assert(Slots > 0, "CachedLocking<> needs at least one slot");
+};
+// Adds to `Policy` a Bloom filter over the known keys, rebuilt after each
+// change like snapshots, which rejects most unknown keys before taking any
+// lock or probing any table. Worth it when most lookups miss.
+template <typename Policy> struct FilteredLocking {};
+
+// Select the locking policy of the registries of base class T, by
+// specializing this trait before any class is registered for T:
+//
+//   namespace factory {
+//   template <> struct LockingPolicy<Shape> {
+//     typedef ReaderWriterLocking type;
+//   };
+//   }
+template <typename T> struct LockingPolicy { typedef SnapshotLocking type; };
+
+//*****************************************************************************
+// Implementation details of Registry<>.
+//*****************************************************************************
+
+#if __cplusplus >= 201703L
+typedef std::shared_mutex ReaderWriterMutex;
+#else
+// Minimal reader-writer lock standing in for std::shared_mutex before
+// C++17. A waiting writer keeps new readers out so that it is not starved.
+class ReaderWriterMutex {
+public:
+  ReaderWriterMutex() : writer_(false), readers_(0) {}
+
+  void lock() {
+    while (writer_.exchange(true)) {
+      std::this_thread::yield();
     }
-    for (const auto &iter : *GetInjectors()) {
-      keys.emplace_back(iter.first + "*");
+    while (readers_.load() != 0) {
+      std::this_thread::yield();
     }
-    registry_mutex_.unlock();
-    return keys;
   }
+  void unlock() { writer_.store(false); }
 
-  // Like GetKeys() function, but also returns the filename
-  // and line number of the corresponding REGISTER() macros.
-  // For injectors, the filename and line number are those
-  // passed to the injector constructor.
-  static std::vector<std::string> GetKeysWithLocations() {
-    std::vector<std::string> keys;
-    registry_mutex_.lock();
-    for (const auto &iter : *GetRegistry()) {
-      keys.emplace_back(std::string(iter.second.file) + ":" +
-                        std::string(iter.second.line) + ": " + iter.first);
-    }
-    for (const auto &iter : *GetInjectors()) {
-      keys.emplace_back(std::string(iter.second.file) + ":" +
-                        std::string(iter.second.line) + ": " + iter.first +
-                        "*");
+  void lock_shared() {
+    for (;;) {
+      while (writer_.load()) {
+        std::this_thread::yield();
+      }
+      readers_.fetch_add(1);
+      if (!writer_.load()) {
+        return;
+      }
+      readers_.fetch_sub(1);
     }
-    registry_mutex_.unlock();
-    return keys;
   }
+  void unlock_shared() { readers_.fetch_sub(1); }
 
-  // Helper class which uses RAII to inject a factory which will be used
-  // instead of any class registered with the same key, for any call
-  // within the scope of the variable.
-  // If there are two injectors in the same scope for the same key,
-  // the last one takes precedence and cancels the first one, which will
-  // never be active, even if the second one gets out of scope.
-  struct Injector {
-    const std::string &key;
-    Injector(const std::string &key,
-             const std::function<T *(Args...)> &function,
-             const char *file = "undefined", const char *line = "undefined")
-        : key(key) {
-      registry_mutex_.lock();
-      const Entry entry = {file, line, function};
-      GetInjectors()->insert(std::make_pair(key, entry));
-      registry_mutex_.unlock();
+private:
+  std::atomic<bool> writer_;
+  std::atomic<int> readers_;
+};
+#endif
+
+// Like std::shared_lock, which is not available before C++14.
+class ReaderLock {
+public:
+  explicit ReaderLock(ReaderWriterMutex &mutex) : mutex_(mutex) {
+    mutex_.lock_shared();
+  }
+  ~ReaderLock() { mutex_.unlock_shared(); }
+
+private:
+  ReaderLock(const ReaderLock &) = delete;
+  ReaderLock &operator=(const ReaderLock &) = delete;
+
+  ReaderWriterMutex &mutex_;
+};
+
+// ThreadSanitizer does not support std::atomic_thread_fence(), which the
+// Reclaimer then replaces with read-modify-writes.
+#if defined(__SANITIZE_THREAD__)
+#define REGISTERER_THREAD_SANITIZER
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define REGISTERER_THREAD_SANITIZER
+#endif
+#endif
+
+// Epoch based reclamation of what lookups may still be using after it was
+// replaced or removed: snapshots, filters and the entries of injectors. A
+// thread is pinned while it looks up a key and uses what it found. Retired
+// objects are freed once no thread pinned before they were retired is still
+// pinned, by Reclaim() or when a thread that may have held them unpins.
+// Pinning writes no shared memory, but costs a fence.
+class Reclaimer {
+  struct Record;
+
+public:
+  // Pins the calling thread during its lifetime. Pins can be nested, e.g.
+  // when a constructor called by New() looks up another key.
+  class Pin {
+  public:
+    Pin() : record_(GetRecord()) {
+      if (record_->depth++ == 0) {
+        PinAt(record_, Get()->epoch_.load());
+      }
     }
-    ~Injector() {
-      registry_mutex_.lock();
-      GetInjectors()->erase(key);
-      registry_mutex_.unlock();
+    ~Pin() {
+      if (--record_->depth == 0) {
+        const std::uint64_t epoch =
+            record_->epoch.load(std::memory_order_relaxed);
+        record_->epoch.store(0, std::memory_order_release);
+        // Only try when this thread may have held back what was retired,
+        // or when more was retired since the last attempt failed, so that
+        // a thread pinned for long does not send every other thread to
+        // Reclaim(). Without a fence, objects retired while this thread
+        // was pinned may not be seen yet, and are freed by a later attempt.
+        Reclaimer *reclaimer = Get();
+        if (reclaimer->pending_.load(std::memory_order_relaxed) != 0) {
+          const std::uint64_t current =
+              reclaimer->epoch_.load(std::memory_order_relaxed);
+          const std::uint64_t attempted =
+              reclaimer->attempted_.load(std::memory_order_relaxed);
+          if (epoch < current || current != attempted) {
+            reclaimer->Reclaim();
+          }
+        }
+      }
     }
+
+  private:
+    Pin(const Pin &) = delete;
+    Pin &operator=(const Pin &) = delete;
+
+    Record *const record_;
   };
-  //***************************************************************************
-  // Implementation details that can't be made private because used in macros
-  //***************************************************************************
-  typedef std::function<T *(Args...)> function_t;
 
-  struct Registerer {
-    Registerer(function_t function, const std::string &key, const char *file,
-               const char *line) {
-      const Entry entry = {file, line, function};
-      registry_mutex_.lock();
-      GetRegistry()->insert(std::make_pair(key, entry));
-      registry_mutex_.unlock();
+  // Never destroyed, so that injectors destroyed at exit can still use it.
+  static Reclaimer *Get() {
+    static Reclaimer *const reclaimer = new Reclaimer;
+    return reclaimer;
+  }
+
+  // Free `object` once the threads pinned so far have unpinned. It must no
+  // longer be reachable by new lookups. Call Reclaim() to free it right
+  // away if possible: Retire() does not, as it may be called with locks
+  // held that the destructor of `object` could take.
+  void Retire(std::shared_ptr<const void> object) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired_.push_back(Retired{epoch_.fetch_add(1) + 1, std::move(object)});
+    pending_.store(retired_.size(), std::memory_order_relaxed);
+  }
+
+  // Free the retired objects that no pinned thread can be using. Their
+  // destructors run without any lock held.
+  void Reclaim() {
+    std::vector<Retired> freed;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+#ifdef REGISTERER_THREAD_SANITIZER
+      epoch_.fetch_add(0);
+#else
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+      std::uint64_t oldest = ~0ULL;
+      for (Record *record = records_.load(std::memory_order_acquire); record;
+           record = record->next) {
+        // Acquire, so that what a thread read before unpinning happens
+        // before the objects are freed.
+        const std::uint64_t epoch =
+            record->epoch.load(std::memory_order_acquire);
+        if (epoch != 0) {
+          oldest = std::min(oldest, epoch);
+        }
+      }
+      // A thread pinned at epoch E can only be using objects retired after
+      // E, which are retired in increasing epochs.
+      std::size_t count = 0;
+      while (count < retired_.size() && retired_[count].epoch <= oldest) {
+        ++count;
+      }
+      freed.assign(std::make_move_iterator(retired_.begin()),
+                   std::make_move_iterator(retired_.begin() + count));
+      retired_.erase(retired_.begin(), retired_.begin() + count);
+      pending_.store(retired_.size(), std::memory_order_relaxed);
+      attempted_.store(epoch_.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
     }
-  };
+  }
 
 private:
-  struct Entry {
-    const char *const file;
-    const char *const line;
-    const function_t function;
+  // State of a thread, which is given back when the thread exits and then
+  // reused by the next new thread. Records are never freed. Each one has
+  // its own cache line, as pinning writes it with a locked instruction.
+  struct alignas(64) Record {
+    // Epoch at which the thread was pinned, or zero.
+    std::atomic<std::uint64_t> epoch;
+    std::atomic<bool> used;
+    // Number of nested pins, only accessed by the thread.
+    std::size_t depth;
+    Record *next;
   };
-  typedef std::map<std::string, Entry> EntryMap;
-  // The registry and injectors are created on demand using static variables
-  // inside a static method so that there is no order initialization fiasco.
-  static EntryMap *GetRegistry() {
-    static EntryMap registry;
-    return &registry;
-  }
-  static EntryMap *GetInjectors() {
-    static EntryMap injectors;
-    return &injectors;
+  struct Retired {
+    std::uint64_t epoch;
+    std::shared_ptr<const void> object;
   };
-  static std::mutex registry_mutex_;
 
-  static std::pair<bool, const Entry *> GetEntry(const std::string &key,
-                                                 Args... args) {
-    registry_mutex_.lock();
-    auto it = GetInjectors()->find(key);
-    bool found = (it != GetInjectors()->end());
-    if (!found) {
-      it = GetRegistry()->find(key);
-      found = (it != GetRegistry()->end());
+  Reclaimer() : epoch_(1), pending_(0), attempted_(0), records_(nullptr) {}
+
+  // Store the epoch at which a thread is pinned, ordered before the reads
+  // of its lookup as by a sequentially consistent fence, which pairs with
+  // the one in Reclaim(). On x86, a locked instruction does it for less.
+  static void PinAt(Record *record, std::uint64_t epoch) {
+#if defined(__x86_64__) || defined(__i386__) ||                               \
+    defined(REGISTERER_THREAD_SANITIZER)
+    record->epoch.exchange(epoch);
+#else
+    record->epoch.store(epoch, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+  }
+
+  static Record *GetRecord() {
+    struct Owner {
+      Record *const record;
+      ~Owner() { record->used.store(false, std::memory_order_release); }
+    };
+    static thread_local const Owner owner = {Get()->Acquire()};
+    return owner.record;
+  }
+
+  Record *Acquire() {
+    for (Record *record = records_.load(std::memory_order_acquire); record;
+         record = record->next) {
+      bool used = false;
+      if (!record->used.load(std::memory_order_relaxed) &&
+          record->used.compare_exchange_strong(used, true)) {
+        return record;
+      }
     }
-    registry_mutex_.unlock();
-    return std::make_pair(found, &(it->second));
+    // Aligned by hand, as new only aligns over-aligned types since C++17.
+    std::size_t space = sizeof(Record) + alignof(Record);
+    void *block = ::operator new(space);
+    Record *record = new (std::align(alignof(Record), sizeof(Record), block,
+                                     space)) Record{{0}, {true}, 0, nullptr};
+    record->next = records_.load(std::memory_order_relaxed);
+    while (!records_.compare_exchange_weak(record->next, record,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+    }
+    return record;
   }
+
+  std::atomic<std::uint64_t> epoch_;
+  // Size of retired_, read by threads when they unpin.
+  std::atomic<std::size_t> pending_;
+  // Value of epoch_ at the last call to Reclaim().
+  std::atomic<std::uint64_t> attempted_;
+  std::atomic<Record *> records_;
+  std::mutex mutex_;
+  std::vector<Retired> retired_;
 };
 
-template <typename T, class... Args>
-std::mutex Registry<T, Args...>::registry_mutex_;
+// Pass a parameter of Registry<>::New() to a factory taking `Arg&&`.
+// Rvalues and parameters for reference arguments are forwarded as is,
+// converted by the factory call if needed. Lvalues for arguments taken by
+// value are copied into a temporary, which the constructor can move from.
+template <typename Arg, typename Param>
+typename std::enable_if<std::is_reference<Arg>::value ||
+                            !std::is_lvalue_reference<Param>::value,
+                        Param &&>::type
+PassArgument(Param &&param) {
+  return std::forward<Param>(param);
+}
 
-//*****************************************************************************
-// Implementation details of REGISTER() macro.
-//
-// Creates uniquely named traits class and functions which forces the
-// instantiation of a TypeRegisterer class with a static member doing the
-// actual registration in the registry. Note that TypeRegisterer being a
-// template, there is no violation of the One Definition Rule. The use of
-// Trait class is way to pass back information from the class where the
-// macro is called, to the definition of TypeRegisterer static member.
-// This works only because the Trait functions do not reference any other
-// static variable, or it would create an initialization order fiasco.
-//*****************************************************************************
-template <typename Trait, typename base_type, typename derived_type,
-          typename... Args>
-struct TypeRegisterer {
-  static const typename Registry<base_type, Args...>::Registerer instance;
+template <typename Arg, typename Param>
+typename std::enable_if<!std::is_reference<Arg>::value &&
+                            std::is_lvalue_reference<Param>::value,
+                        Arg>::type
+PassArgument(Param &&param) {
+  // Copy initialized, so that only implicit conversions are allowed.
+  return param;
+}
+
+// Whether each of the parameters in tuple `Params` implicitly converts to
+// the argument at the same position in tuple `Args`, as when calling a
+// function taking those arguments. Lists of different sizes are left to
+// the static assertions on their sizes.
+template <typename Params, typename Args>
+struct AreConvertible : std::true_type {};
+template <typename Param, typename... Params, typename Arg, typename... Args>
+struct AreConvertible<std::tuple<Param, Params...>, std::tuple<Arg, Args...>>
+    : std::integral_constant<
+          bool, std::is_convertible<Param, Arg>::value &&
+                    AreConvertible<std::tuple<Params...>,
+                                   std::tuple<Args...>>::value> {};
+
+// Whether `U` derives from std::enable_shared_from_this<>, which only a
+// std::shared_ptr<> constructed from a pointer to `U` sets up.
+template <typename U> class SharesFromThis {
+  template <typename V>
+  static std::true_type Test(const std::enable_shared_from_this<V> *);
+  static std::false_type Test(...);
+
+public:
+  static constexpr bool value =
+      decltype(Test(static_cast<const U *>(nullptr)))::value;
 };
 
-template <typename Trait, typename base_type, typename derived_type,
-          typename... Args>
-const typename Registry<base_type, Args...>::Registerer 
-TypeRegisterer<Trait, base_type, derived_type, Args...>::instance(
-    [](Args... args) { return new derived_type(args...); },
-    Trait::key(), Trait::file(), Trait::line());
+// C++11 stand-in for std::index_sequence, used to unpack the parameters
+// stored by Registry<>::With().
+template <std::size_t... I> struct IndexSequence {};
+template <std::size_t N, std::size_t... I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+template <std::size_t... I>
+struct MakeIndexSequence<0, I...> : IndexSequence<I...> {};
 
-#define CONCAT_TOKENS(x, y) x##y
-#define STRINGIFY(x) #x
+// Steps of the hash of keys, shared by HashKey() and ConstexprHashKey().
+// Keys are hashed 8 bytes at a time, read as little-endian words, the last
+// word being padded with zeros. The size of the key is mixed in the seed.
+constexpr std::uint64_t HashSeed(std::size_t size) {
+  return 0xcbf29ce484222325ULL ^ (size * 0x9e3779b97f4a7c15ULL);
+}
+constexpr std::uint64_t RotateHash(std::uint64_t hash) {
+  return (hash << 27) | (hash >> 37);
+}
+constexpr std::uint64_t HashStep(std::uint64_t hash, std::uint64_t word) {
+  return RotateHash(hash ^ (word * 0x9e3779b97f4a7c15ULL)) *
+         0xc2b2ae3d27d4eb4fULL;
+}
+constexpr std::uint64_t ShiftHash(std::uint64_t hash) {
+  return hash ^ (hash >> 33);
+}
+constexpr std::uint64_t HashFinish(std::uint64_t hash) {
+  return ShiftHash(ShiftHash(ShiftHash(hash) * 0xff51afd7ed558ccdULL) *
+                   0xc4ceb9fe1a85ec53ULL);
+}
+
+// Little-endian word of the 8 bytes at `data`.
+inline std::uint64_t LoadWord(const char *data) {
+  std::uint64_t word;
+  std::memcpy(&word, data, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+// Hash of a key, processing 8 bytes per step.
+inline std::uint64_t HashKey(KeyView key) {
+  if (key.has_hash()) {
+    return key.hash();
+  }
+  const char *data = key.data();
+  std::size_t size = key.size();
+  std::uint64_t hash = HashSeed(size);
+  for (; size > 8; data += 8, size -= 8) {
+    hash = HashStep(hash, LoadWord(data));
+  }
+  if (key.size() >= 8) {
+    // The last 1 to 8 bytes, read from the 8 bytes ending the key.
+    hash = HashStep(hash, LoadWord(data + size - 8) >> (64 - 8 * size));
+  } else if (size > 0) {
+    std::uint64_t word = 0;
+    for (std::size_t i = size; i > 0; --i) {
+      word = (word << 8) | static_cast<unsigned char>(data[i - 1]);
+    }
+    hash = HashStep(hash, word);
+  }
+  return HashFinish(hash);
+}
+
+// Same hash as HashKey(), written with single expressions so that it can be
+// computed at compile time by REGISTRY_KEY().
+constexpr std::uint64_t ConstexprLoadWord(const char *data, std::size_t size) {
+  return size == 0 ? 0
+                   : static_cast<unsigned char>(*data) |
+                         (ConstexprLoadWord(data + 1, size - 1) << 8);
+}
+constexpr std::uint64_t ConstexprHashWords(const char *data, std::size_t size,
+                                           std::uint64_t hash) {
+  return size == 0 ? hash
+         : size <= 8
+             ? HashStep(hash, ConstexprLoadWord(data, size))
+             : ConstexprHashWords(data + 8, size - 8,
+                                  HashStep(hash, ConstexprLoadWord(data, 8)));
+}
+constexpr std::uint64_t ConstexprHashKey(const char *data, std::size_t size) {
+  return HashFinish(ConstexprHashWords(data, size, HashSeed(size)));
+}
+
+// Forces `Hash` to be computed at compile time, being a template argument.
+template <std::uint64_t Hash> struct ConstantHash {
+  static constexpr std::uint64_t value = Hash;
+};
+
+// Derive from a key hash a well mixed value that depends on `seed`.
+inline std::uint64_t MixHash(std::uint64_t hash, std::uint64_t seed) {
+  hash ^= seed * 0x9e3779b97f4a7c15ULL;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  return hash ^ (hash >> 33);
+}
+
+// Map a mixed hash to [0, size) with a multiplication instead of a modulo.
+inline std::size_t ReduceHash(std::uint64_t mixed, std::size_t size) {
+  return static_cast<std::size_t>(((mixed >> 32) * size) >> 32);
+}
+
+// Hash table with open addressing and linear probing, indexing values by
+// their `key` member. Slots are contiguous and store the key hash next to
+// the value pointer, so that probing rarely needs to dereference a value.
+// Values are not owned.
+template <typename Value> class HashIndex {
+public:
+  HashIndex() : size_(0) {}
+
+  constexpr std::size_t size() const { return size_; }
+
+  const Value *Find(KeyView key, std::uint64_t hash) const {
+    if (slots_.empty()) {
+      return nullptr;
+    }
+    const std::size_t mask = slots_.size() - 1;
+    for (std::size_t i = Home(hash, mask);; i = (i + 1) & mask) {
+      const Slot &slot = slots_[i];
+      if (!slot.value) {
+        return nullptr;
+      }
+      if (slot.hash == hash && KeyView(slot.value->key) == key) {
+        return slot.value;
+      }
+    }
+  }
+
+  // Insert `value` unless there is already a value with the same key,
+  // in which case the index is left unchanged and 'false' is returned.
+  bool Insert(const Value *value) {
+    const std::uint64_t hash = HashKey(value->key);
+    if (Find(value->key, hash)) {
+      return false;
+    }
+    if (2 * (size_ + 1) > slots_.size()) {
+      Grow();
+    }
+    const Slot slot = {hash, value};
+    Place(slot);
+    ++size_;
+    return true;
+  }
+
+  // Remove the value with the given key, if any.
+  bool Erase(KeyView key) {
+    if (slots_.empty()) {
+      return false;
+    }
+    const std::uint64_t hash = HashKey(key);
+    const std::size_t mask = slots_.size() - 1;
+    std::size_t hole = Home(hash, mask);
+    for (;; hole = (hole + 1) & mask) {
+      const Slot &slot = slots_[hole];
+      if (!slot.value) {
+        return false;
+      }
+      if (slot.hash == hash && KeyView(slot.value->key) == key) {
+        break;
+      }
+    }
+    // Shift back the following values of the cluster whose home slot is
+    // not between the hole and themselves, so that no tombstone is needed.
+    for (std::size_t i = (hole + 1) & mask; slots_[i].value;
+         i = (i + 1) & mask) {
+      const std::size_t home = Home(slots_[i].hash, mask);
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        slots_[hole] = slots_[i];
+        hole = i;
+      }
+    }
+    slots_[hole] = Slot();
+    --size_;
+    return true;
+  }
+
+  template <typename Function> void ForEach(Function function) const {
+    for (const Slot &slot : slots_) {
+      if (slot.value) {
+        function(*slot.value);
+      }
+    }
+  }
+
+private:
+  struct Slot {
+    std::uint64_t hash;
+    const Value *value;
+  };
+
+  static std::size_t Home(std::uint64_t hash, std::size_t mask) {
+    return static_cast<std::size_t>(hash ^ (hash >> 32)) & mask;
+  }
+
+  void Grow() {
+    std::vector<Slot> slots(std::max<std::size_t>(8, 2 * slots_.size()),
+                            Slot());
+    slots_.swap(slots);
+    for (const Slot &slot : slots) {
+      if (slot.value) {
+        Place(slot);
+      }
+    }
+  }
+
+  void Place(const Slot &slot) {
+    const std::size_t mask = slots_.size() - 1;
+    std::size_t i = Home(slot.hash, mask);
+    while (slots_[i].value) {
+      i = (i + 1) & mask;
+    }
+    slots_[i] = slot;
+  }
+
+  std::vector<Slot> slots_;
+  std::size_t size_;
+};
+
+// Blocked Bloom filter over key hashes, telling whether a key may have been
+// added. Each key sets 3 bits in a single 64-bit word, so that a query reads
+// one word. With 16 bits per key, about 1% of the keys that were not added
+// get through.
+class KeyFilter {
+public:
+  explicit KeyFilter(std::size_t count) {
+    std::size_t words = 1;
+    while (words * 4 < count) {
+      words *= 2;
+    }
+    words_.assign(words, 0);
+  }
+
+  void Add(std::uint64_t hash) {
+    const std::uint64_t mixed = Mix(hash);
+    words_[Word(mixed)] |= Bits(mixed);
+  }
+  bool MayContain(std::uint64_t hash) const {
+    const std::uint64_t mixed = Mix(hash);
+    const std::uint64_t bits = Bits(mixed);
+    return (words_[Word(mixed)] & bits) == bits;
+  }
+
+private:
+  static std::uint64_t Mix(std::uint64_t hash) {
+    return hash * 0x9e3779b97f4a7c15ULL;
+  }
+  std::size_t Word(std::uint64_t mixed) const {
+    return static_cast<std::size_t>(mixed >> 32) & (words_.size() - 1);
+  }
+  static std::uint64_t Bits(std::uint64_t mixed) {
+    return (1ULL << (mixed & 63)) | (1ULL << ((mixed >> 6) & 63)) |
+           (1ULL << ((mixed >> 12) & 63));
+  }
 
+  std::vector<std::uint64_t> words_;
+};
+
+#ifdef REGISTERER_USE_SECTIONS
+#ifndef __ELF__
+#error "REGISTERER_USE_SECTIONS requires a target using ELF binaries"
+#endif
+// Constant record emitted by REGISTER() into the "registerer" section of
+// the binary. `registry` identifies the Registry<> to which the class is
+// added, and `registration` points to its Registry<>::Registration.
+struct SectionRecord {
+  const void *registry;
+  const void *registration;
+};
+
+// Bounds of the "registerer" section, defined by the linker. They are
+// null if the binary has no such section.
+extern "C" const SectionRecord __start_registerer[] __attribute__((weak));
+extern "C" const SectionRecord __stop_registerer[] __attribute__((weak));
+#endif
+
+// Minimal perfect hash over a fixed set of values, indexed by their `key`
+// member, built with the hash and displace method: keys are spread into
+// buckets, and each bucket gets a seed sending all its keys to free slots.
+// A lookup is then one key hash, one integer mix and one key comparison.
+// Values are not owned.
+template <typename Value> class PerfectHashIndex {
+public:
+  // Return 'false' if no perfect hash could be found, which only happens
+  // if two keys have the same 64-bit hash.
+  bool Build(const std::vector<const Value *> &values) {
+    const std::size_t count = values.size();
+    seeds_.assign(std::max<std::size_t>(1, count / 3), 0);
+    slots_.assign(count, Slot());
+    std::vector<std::uint64_t> hashes(count);
+    std::vector<std::uint64_t> mixed(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      hashes[i] = HashKey(values[i]->key);
+      mixed[i] = MixHash(hashes[i], 0);
+    }
+    std::vector<std::uint64_t> sorted(hashes);
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+      return false;
+    }
+    std::vector<std::vector<std::size_t>> buckets(seeds_.size());
+    for (std::size_t i = 0; i < count; ++i) {
+      buckets[Bucket(mixed[i], seeds_.size())].push_back(i);
+    }
+    // Place big buckets first, while there are many free slots.
+    std::vector<std::size_t> order(buckets.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&buckets](std::size_t a, std::size_t b) {
+                       return buckets[a].size() > buckets[b].size();
+                     });
+    // The last keys placed need on average `count` tries to find the
+    // last free slots, so this bound is only reached on hash collisions.
+    const std::uint32_t max_seed = static_cast<std::uint32_t>(
+        std::min<std::uint64_t>(0xffffffffULL, 64 * count + 65536));
+    std::vector<std::size_t> positions;
+    for (std::size_t b : order) {
+      const std::vector<std::size_t> &bucket = buckets[b];
+      std::uint32_t seed = 1;
+      for (;; ++seed) {
+        if (seed > max_seed) {
+          return false;
+        }
+        positions.clear();
+        for (std::size_t i : bucket) {
+          const std::size_t position = Position(mixed[i], seed, count);
+          if (slots_[position].value ||
+              std::find(positions.begin(), positions.end(), position) !=
+                  positions.end()) {
+            break;
+          }
+          positions.push_back(position);
+        }
+        if (positions.size() == bucket.size()) {
+          break;
+        }
+      }
+      seeds_[b] = seed;
+      for (std::size_t i = 0; i < bucket.size(); ++i) {
+        const Slot slot = {hashes[bucket[i]], values[bucket[i]]};
+        slots_[positions[i]] = slot;
+      }
+    }
+    return true;
+  }
+
+  const Value *Find(KeyView key, std::uint64_t hash) const {
+    if (slots_.empty()) {
+      return nullptr;
+    }
+    const std::uint64_t mixed = MixHash(hash, 0);
+    const std::uint32_t seed = seeds_[Bucket(mixed, seeds_.size())];
+    const Slot &slot = slots_[Position(mixed, seed, slots_.size())];
+    if (slot.hash == hash && KeyView(slot.value->key) == key) {
+      return slot.value;
+    }
+    return nullptr;
+  }
+
+private:
+  struct Slot {
+    std::uint64_t hash;
+    const Value *value;
+  };
+
+  // The bucket uses the low half of the mixed hash, and the position
+  // the high half once displaced by the seed of the bucket.
+  static std::size_t Bucket(std::uint64_t mixed, std::size_t buckets) {
+    return static_cast<std::size_t>(((mixed & 0xffffffffULL) * buckets) >> 32);
+  }
+  static std::size_t Position(std::uint64_t mixed, std::uint32_t seed,
+                              std::size_t size) {
+    return ReduceHash((mixed ^ seed) * 0x9e3779b97f4a7c15ULL, size);
+  }
+
+  std::vector<std::uint32_t> seeds_;
+  std::vector<Slot> slots_;
+};
+
+template <typename T, class... Args> class Registry {
+  struct Entry;
+  struct Injected;
+  class EntryRef;
+  class Pool;
+  struct Shared;
+  template <typename... Params>
+  using Convertible =
+      AreConvertible<std::tuple<Params...>, std::tuple<Args...>>;
+  // Removes the functions whose parameters do not all convert implicitly
+  // to Args from overload resolution.
+  template <typename... Params>
+  using IfConvertible =
+      typename std::enable_if<Convertible<Params...>::value>::type;
+
+public:
+  // Return 'true' if there is a class registered for `key` for
+  // a constructor with signature (Args... args).
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params...>>
+  static bool CanNew(KeyView key, Params &&...) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "CanNew() must be passed one parameter per argument");
+    return static_cast<bool>(EntryRef(key));
+  }
+  // Overload for the parameters that convert to Args once their type is
+  // known, such as 0 or NULL for a pointer, or a braced initializer list.
+  static bool CanNew(KeyView key, Args...) {
+    return static_cast<bool>(EntryRef(key));
+  }
+
+  // If there is a class registered for `key` for a constructor
+  // with signature (Args... args), instantiate an object of that class
+  // passing args to the constructor. Returns a null pointer otherwise.
+  //
+  // Parameters are forwarded to the constructor: an argument taken by
+  // value is moved from an rvalue, or copied once from an lvalue, which
+  // allows move-only arguments such as std::unique_ptr<>.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params...>>
+  static std::unique_ptr<T> New(KeyView key, Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "New() must be passed one parameter per argument");
+    const EntryRef entry(key);
+    return std::unique_ptr<T>(
+        entry ? entry->Create(PassArgument<Args>(
+                    std::forward<Params>(params))...)
+              : nullptr);
+  }
+  // Overload for the parameters that convert to Args once their type is
+  // known, such as 0 or NULL for a pointer, or a braced initializer list.
+  static std::unique_ptr<T> New(KeyView key, Args... args) {
+    return New<Args...>(key, std::forward<Args>(args)...);
+  }
+
+  // Like New(), but with a single lookup telling whether there is a class
+  // registered for `key` apart from what the factory returned: return
+  // 'false' if there is none, and otherwise 'true' with the created
+  // object, which may be null for an injector, stored in `result`. Unlike
+  // CanNew() followed by New(), an injector going out of scope in
+  // another thread can not make the second call fail.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params...>>
+  static bool TryNew(KeyView key, std::unique_ptr<T> *result,
+                     Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "TryNew() must be passed one parameter per argument");
+    const EntryRef entry(key);
+    if (!entry) {
+      return false;
+    }
+    result->reset(
+        entry->Create(PassArgument<Args>(std::forward<Params>(params))...));
+    return true;
+  }
+
+  // Parameters for the constructor of classes of this registry, returned
+  // by With() to be tried by TryNewAny().
+  template <typename... Params> class Bound {
+  public:
+    bool TryNew(KeyView key, std::unique_ptr<T> *result) {
+      return TryNew(key, result, MakeIndexSequence<sizeof...(Params)>());
+    }
+
+  private:
+    friend class Registry;
+    explicit Bound(Params &&... params)
+        : params_(std::forward<Params>(params)...) {}
+
+    template <std::size_t... I>
+    bool TryNew(KeyView key, std::unique_ptr<T> *result,
+                IndexSequence<I...>) {
+      return Registry::TryNew(
+          key, result, std::forward<Params>(std::get<I>(params_))...);
+    }
+
+    // References to the parameters, which must outlive the object.
+    std::tuple<Params &&...> params_;
+  };
+
+  // Bind parameters for a constructor with signature (Args... args),
+  // which TryNewAny() tries along with other signatures.
+  template <typename... Params, typename = IfConvertible<Params...>>
+  static Bound<Params...> With(Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "With() must be passed one parameter per argument");
+    return Bound<Params...>(std::forward<Params>(params)...);
+  }
+
+  // Describes a class registered with REGISTER(), so that memory can be
+  // prepared for it without constructing an instance first.
+  struct ClassInfo {
+    std::size_t size;
+    std::size_t alignment;
+    bool trivially_destructible;
+    // Construct an instance in memory provided by the caller.
+    T *(*construct)(void *where, Args &&...);
+    // Move the instance at `from` to `where` and destroy the former. Null
+    // if the class can not be move constructed.
+    T *(*relocate)(void *where, void *from);
+  };
+
+  // Return the description of the class registered for `key`, or null if
+  // there is none or if the key is provided by an injector, whose factory
+  // can create objects of any class. The description lives forever.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  static const ClassInfo *GetClassInfo(KeyView key) {
+    const EntryRef entry(key);
+    return entry ? entry->info : nullptr;
+  }
+
+  // Construct the class registered for `key` in the `size` bytes at
+  // `buffer`, e.g. to store polymorphic objects in a flat array. Return
+  // null, without calling any constructor, if there is no such class, if
+  // the key is provided by an injector, or if the buffer is too small or
+  // not aligned enough for the class (see GetClassInfo()). The caller is
+  // responsible for calling the destructor of the returned object.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params...>>
+  static T *NewAt(void *buffer, std::size_t size, KeyView key,
+                  Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "NewAt() must be passed one parameter per argument");
+    const ClassInfo *info = GetClassInfo(key);
+    if (!info || size < info->size ||
+        reinterpret_cast<std::uintptr_t>(buffer) % info->alignment != 0) {
+      return nullptr;
+    }
+    return info->construct(buffer,
+                           PassArgument<Args>(std::forward<Params>(params))...);
+  }
+
+  // Like New(), but constructs `count` objects for `key`, looking up the
+  // key only once. Parameters are passed to each constructor as lvalues,
+  // so arguments taken by value are copied for each object. Return an
+  // empty vector if there is no class registered for `key`.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params &...>>
+  static std::vector<std::unique_ptr<T>>
+  NewMany(KeyView key, std::size_t count, Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "NewMany() must be passed one parameter per argument");
+    std::vector<std::unique_ptr<T>> objects;
+    const EntryRef entry(key);
+    if (!entry) {
+      return objects;
+    }
+    objects.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      objects.emplace_back(entry->Create(PassArgument<Args>(params)...));
+    }
+    return objects;
+  }
+
+  // Objects created by NewSlab(), stored next to each other in a single
+  // block of memory when possible, and destroyed along with the slab.
+  class Slab {
+  public:
+    typedef typename std::vector<T *>::const_iterator const_iterator;
+
+    Slab() : block_(nullptr) {}
+    Slab(Slab &&other) : block_(nullptr) { *this = std::move(other); }
+    Slab &operator=(Slab &&other) {
+      if (this != &other) {
+        clear();
+        objects_.swap(other.objects_);
+        std::swap(block_, other.block_);
+      }
+      return *this;
+    }
+    ~Slab() { clear(); }
+
+    std::size_t size() const { return objects_.size(); }
+    bool empty() const { return objects_.empty(); }
+    T *operator[](std::size_t i) const { return objects_[i]; }
+    const_iterator begin() const { return objects_.begin(); }
+    const_iterator end() const { return objects_.end(); }
+
+    // Return 'true' if the objects share one block of memory.
+    bool is_contiguous() const { return block_ != nullptr; }
+
+    // Destroy all the objects.
+    void clear() {
+      for (T *object : objects_) {
+        if (block_) {
+          object->~T();
+        } else {
+          delete object;
+        }
+      }
+      objects_.clear();
+      ::operator delete(block_);
+      block_ = nullptr;
+    }
+
+  private:
+    friend class Registry;
+
+    std::vector<T *> objects_;
+    // Null if objects are allocated one by one.
+    void *block_;
+  };
+
+  // Like NewMany(), but constructs the objects in a single block of memory,
+  // saving an allocation per object and keeping them close in memory.
+  // Factories provided by injectors and over-aligned classes allocate
+  // each object separately instead.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params &...>>
+  static Slab NewSlab(KeyView key, std::size_t count, Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "NewSlab() must be passed one parameter per argument");
+    Slab slab;
+    const EntryRef entry(key);
+    if (!entry || count == 0) {
+      return slab;
+    }
+    // Reserved so that adding objects does not throw. If a constructor
+    // throws, the slab destroys the objects constructed so far.
+    slab.objects_.reserve(count);
+    const ClassInfo *info = entry->info;
+    if (!info ||
+        info->alignment > std::alignment_of<std::max_align_t>::value) {
+      for (std::size_t i = 0; i < count; ++i) {
+        slab.objects_.push_back(entry->Create(PassArgument<Args>(params)...));
+      }
+      return slab;
+    }
+    // sizeof() is a multiple of the alignment, so all objects are aligned.
+    char *block = static_cast<char *>(::operator new(info->size * count));
+    slab.block_ = block;
+    for (std::size_t i = 0; i < count; ++i) {
+      slab.objects_.push_back(info->construct(block + i * info->size,
+                                              PassArgument<Args>(params)...));
+    }
+    return slab;
+  }
+
+  // Polymorphic holder of an object created by NewInline<N>(), which is
+  // stored inside the holder when it fits in N bytes, and on the heap
+  // otherwise. It owns the object like a std::unique_ptr<T>, and moving
+  // the holder moves an inline object with its move constructor.
+  template <std::size_t N> class Inline {
+    static_assert(N > 0, "Inline<> needs some storage");
+
+  public:
+    Inline() : object_(nullptr), relocate_(nullptr) {}
+    Inline(Inline &&other) : object_(nullptr), relocate_(nullptr) {
+      *this = std::move(other);
+    }
+    Inline &operator=(Inline &&other) {
+      if (this != &other) {
+        reset();
+        if (other.relocate_) {
+          object_ = other.relocate_(&storage_, &other.storage_);
+          relocate_ = other.relocate_;
+        } else {
+          object_ = other.object_;
+        }
+        other.object_ = nullptr;
+        other.relocate_ = nullptr;
+      }
+      return *this;
+    }
+    ~Inline() { reset(); }
+
+    T *get() const { return object_; }
+    T *operator->() const { return object_; }
+    T &operator*() const { return *object_; }
+    explicit operator bool() const { return object_ != nullptr; }
+
+    // Return 'true' if the object is stored inside the holder.
+    bool is_inline() const { return relocate_ != nullptr; }
+
+    void reset() {
+      if (relocate_) {
+        object_->~T();
+      } else {
+        delete object_;
+      }
+      object_ = nullptr;
+      relocate_ = nullptr;
+    }
+
+  private:
+    friend class Registry;
+    typedef typename std::aligned_storage<N>::type Storage;
+
+    Storage storage_;
+    T *object_;
+    // Only set for objects stored inline.
+    T *(*relocate_)(void *, void *);
+  };
+
+  // Like New(), but returns a holder storing the object inline if its
+  // class fits in N bytes and can be move constructed, saving a heap
+  // allocation. Factories provided by injectors always use the heap.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <std::size_t N, typename... Params,
+            typename = IfConvertible<Params...>>
+  static Inline<N> NewInline(KeyView key, Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "NewInline() must be passed one parameter per argument");
+    Inline<N> result;
+    const EntryRef entry(key);
+    if (!entry) {
+      return result;
+    }
+    const ClassInfo *info = entry->info;
+    if (info && info->relocate && info->size <= N &&
+        info->alignment <=
+            std::alignment_of<typename Inline<N>::Storage>::value) {
+      result.object_ =
+          info->construct(&result.storage_,
+                          PassArgument<Args>(std::forward<Params>(params))...);
+      result.relocate_ = info->relocate;
+    } else {
+      result.object_ =
+          entry->Create(PassArgument<Args>(std::forward<Params>(params))...);
+    }
+    return result;
+  }
+
+  // Statistics of the pool used by Pooled() for a key.
+  struct PoolStats {
+    // Objects created from an idle block, or from newly allocated memory.
+    std::size_t hits;
+    std::size_t misses;
+    // Blocks currently kept for reuse, and maximum number of such blocks.
+    std::size_t idle;
+    std::size_t capacity;
+  };
+
+  // Deleter of the objects returned by Pooled(), which destroys them and
+  // gives their memory back to the pool of their class.
+  class PoolDeleter {
+  public:
+    PoolDeleter() : pool_(nullptr), block_(nullptr) {}
+
+    void operator()(T *object) const {
+      if (!pool_) {
+        delete object;
+        return;
+      }
+      object->~T();
+      pool_->Release(block_);
+    }
+
+  private:
+    friend class Registry;
+    Pool *pool_;
+    void *block_;
+  };
+  typedef std::unique_ptr<T, PoolDeleter> PooledPtr;
+
+  // Like New(), but takes the memory of the object from a pool of idle
+  // blocks kept for the class registered for `key`, and gives it back to
+  // the pool when the object is deleted. Useful for short-lived objects
+  // that are created over and over with the same key. Pools are created
+  // on demand, keep up to 64 idle blocks unless told otherwise with
+  // SetPoolCapacity(), and are never destroyed before exit.
+  //
+  // Factories provided by injectors and over-aligned classes are not
+  // pooled: their objects are allocated and deleted as with New().
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params...>>
+  static PooledPtr Pooled(KeyView key, Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "Pooled() must be passed one parameter per argument");
+    const EntryRef entry(key);
+    if (!entry) {
+      return PooledPtr();
+    }
+    Pool *pool = GetPool(entry.get());
+    if (!pool) {
+      return PooledPtr(
+          entry->Create(PassArgument<Args>(std::forward<Params>(params))...));
+    }
+    // Gives the block back if the constructor throws.
+    struct Guard {
+      Pool *pool;
+      void *block;
+      ~Guard() {
+        if (block) {
+          pool->Release(block);
+        }
+      }
+    } guard = {pool, pool->Acquire()};
+    PoolDeleter deleter;
+    deleter.pool_ = pool;
+    deleter.block_ = guard.block;
+    T *object = pool->info()->construct(
+        guard.block, PassArgument<Args>(std::forward<Params>(params))...);
+    guard.block = nullptr;
+    return PooledPtr(object, deleter);
+  }
+
+  // Set the maximum number of idle blocks kept by the pool for `key`,
+  // freeing the extra ones. Return 'false' if objects for `key` are not
+  // pooled.
+  static bool SetPoolCapacity(KeyView key, std::size_t capacity) {
+    const EntryRef entry(key);
+    Pool *pool = GetPool(entry.get());
+    if (pool) {
+      pool->SetCapacity(capacity);
+    }
+    return pool != nullptr;
+  }
+
+  // Free all the idle blocks of the pool for `key`.
+  static void TrimPool(KeyView key) {
+    const EntryRef entry(key);
+    if (Pool *pool = GetPool(entry.get())) {
+      pool->Trim();
+    }
+  }
+
+  // Return statistics of the pool for `key`, all zeros if objects for
+  // `key` are not pooled.
+  static PoolStats GetPoolStats(KeyView key) {
+    const EntryRef entry(key);
+    Pool *pool = GetPool(entry.get());
+    const PoolStats none = {0, 0, 0, 0};
+    return pool ? pool->GetStats() : none;
+  }
+
+  // Return an instance of the class registered for `key` shared by all
+  // callers, constructed by the first call with the given parameters,
+  // which later calls ignore. Meant for classes that are immutable once
+  // constructed, e.g. stateless strategies. Threads calling it for the
+  // same key concurrently construct a single instance, and the
+  // constructor runs without any lock of the registry held. Return null
+  // if there is no class registered for `key`, or if its factory
+  // returned null, in which case the next call tries again.
+  //
+  // Each injector gets its own shared instance, released when the
+  // injector goes out of scope.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params...>>
+  static std::shared_ptr<const T> GetShared(KeyView key, Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "GetShared() must be passed one parameter per argument");
+    const EntryRef entry(key);
+    if (!entry) {
+      return nullptr;
+    }
+    Shared *shared = GetSharedSlot(entry.get());
+    std::shared_ptr<const T> instance = std::atomic_load(&shared->instance);
+    if (instance) {
+      return instance;
+    }
+    // The constructor may throw.
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    instance = std::atomic_load(&shared->instance);
+    if (!instance) {
+      instance.reset(
+          entry->Create(PassArgument<Args>(std::forward<Params>(params))...));
+      std::atomic_store(&shared->instance, instance);
+    }
+    return instance;
+  }
+
+  // Drop the shared instance for `key`, so that the next call to
+  // GetShared() constructs a new one. Callers still holding the former
+  // instance keep it alive. Return 'false' if there was none.
+  static bool EvictShared(KeyView key) {
+    const EntryRef entry(key);
+    Shared *shared = entry ? entry->shared.load(std::memory_order_acquire)
+                           : nullptr;
+    return shared && shared->Evict();
+  }
+
+  // Deleter of the objects returned by NewIn(), which destroys them and
+  // gives their memory back to the resource they were allocated from.
+  class ResourceDeleter {
+  public:
+    ResourceDeleter()
+        : resource_(nullptr), deallocate_(nullptr), block_(nullptr),
+          info_(nullptr) {}
+
+    void operator()(T *object) const {
+      if (!deallocate_) {
+        delete object;
+        return;
+      }
+      object->~T();
+      deallocate_(resource_, block_, info_->size, info_->alignment);
+    }
+
+  private:
+    friend class Registry;
+    template <typename Resource>
+    static void Deallocate(void *resource, void *block, std::size_t size,
+                           std::size_t alignment) {
+      static_cast<Resource *>(resource)->deallocate(block, size, alignment);
+    }
+
+    void *resource_;
+    void (*deallocate_)(void *, void *, std::size_t, std::size_t);
+    void *block_;
+    const ClassInfo *info_;
+  };
+  typedef std::unique_ptr<T, ResourceDeleter> ResourcePtr;
+
+  // Like New(), but allocates the object from `resource`, which can be
+  // a std::pmr::memory_resource or any class with the same allocate()
+  // and deallocate() methods. The resource must outlive the object.
+  // With a resource releasing all its memory at once, such as
+  // std::pmr::monotonic_buffer_resource, the objects of a whole request
+  // can be freed together, deleting them only runs their destructor.
+  //
+  // Factories provided by injectors construct objects on the heap, which
+  // the returned pointer then deletes as usual.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename Resource, typename... Params,
+            typename = IfConvertible<Params...>>
+  static ResourcePtr NewIn(Resource *resource, KeyView key,
+                           Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "NewIn() must be passed one parameter per argument");
+    const EntryRef entry(key);
+    if (!entry) {
+      return ResourcePtr();
+    }
+    const ClassInfo *info = entry->info;
+    if (!info) {
+      return ResourcePtr(
+          entry->Create(PassArgument<Args>(std::forward<Params>(params))...));
+    }
+    // Gives the memory back if the constructor throws.
+    struct Guard {
+      Resource *resource;
+      void *block;
+      const ClassInfo *info;
+      ~Guard() {
+        if (block) {
+          resource->deallocate(block, info->size, info->alignment);
+        }
+      }
+    } guard = {resource, resource->allocate(info->size, info->alignment),
+               info};
+    if (!guard.block) {
+      return ResourcePtr();
+    }
+    ResourceDeleter deleter;
+    deleter.resource_ = resource;
+    deleter.deallocate_ = &ResourceDeleter::template Deallocate<Resource>;
+    deleter.block_ = guard.block;
+    deleter.info_ = info;
+    T *object = info->construct(
+        guard.block, PassArgument<Args>(std::forward<Params>(params))...);
+    guard.block = nullptr;
+    return ResourcePtr(object, deleter);
+  }
+
+  // Like New(), but returns a std::shared_ptr<> whose control block is
+  // allocated along with the object, saving the second allocation made
+  // when converting the result of New(). Factories provided by injectors
+  // and over-aligned classes still need two allocations, as do all classes
+  // if T derives from std::enable_shared_from_this<>, for which the object
+  // must be owned through a pointer to T.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename... Params, typename = IfConvertible<Params...>>
+  static std::shared_ptr<T> NewShared(KeyView key, Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "NewShared() must be passed one parameter per argument");
+    const EntryRef entry(key);
+    if (!entry) {
+      return nullptr;
+    }
+    if (!entry->info || SharesFromThis<T>::value ||
+        entry->info->alignment > std::alignment_of<std::max_align_t>::value) {
+      return std::shared_ptr<T>(
+          entry->Create(PassArgument<Args>(std::forward<Params>(params))...));
+    }
+    static HeapResource heap;
+    return MakeShared(ResourceAllocator<char>(&heap), entry->info,
+                      PassArgument<Args>(std::forward<Params>(params))...);
+  }
+
+  // Like NewShared(), but allocates the object and its control block
+  // from `resource`, which can be a std::pmr::memory_resource or any class
+  // with the same allocate() and deallocate() methods (see NewIn()). The
+  // resource must outlive the object. For factories provided by
+  // injectors, and if T derives from std::enable_shared_from_this<>, only
+  // the control block comes from `resource`.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename Resource, typename... Params,
+            typename = IfConvertible<Params...>>
+  static std::shared_ptr<T> NewSharedIn(Resource *resource, KeyView key,
+                                        Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "NewSharedIn() must be passed one parameter per argument");
+    const EntryRef entry(key);
+    if (!entry) {
+      return nullptr;
+    }
+    const ResourceAllocator<char> allocator(resource);
+    if (!entry->info || SharesFromThis<T>::value) {
+      return std::shared_ptr<T>(
+          entry->Create(PassArgument<Args>(std::forward<Params>(params))...),
+          std::default_delete<T>(), allocator);
+    }
+    return MakeShared(allocator, entry->info,
+                      PassArgument<Args>(std::forward<Params>(params))...);
+  }
+
+  // Handle on the factory registered for a key, resolved once so that
+  // instantiating many objects for the same key skips the lookup. It is
+  // cheap to copy, and can be used concurrently from several threads. It
+  // keeps the factory of an injector alive after the injector is destroyed.
+  //
+  // The handle keeps the factory that was active when it was resolved.
+  // IsStale() tells whether a Registerer or an Injector was created or
+  // destroyed since then, and Refresh() resolves the key again, e.g.
+  // to pick up an injector shadowing the key.
+  class Factory {
+  public:
+    Factory() : generation_(0) {}
+
+    // Return 'true' if a class was registered for the key when resolved.
+    explicit operator bool() const { return static_cast<bool>(entry_); }
+    const std::string &key() const { return key_; }
+
+    // Like Registry<>::New(), but without looking up the key.
+    template <typename... Params, typename = IfConvertible<Params...>>
+    std::unique_ptr<T> New(Params &&... params) const {
+      static_assert(sizeof...(Params) == sizeof...(Args),
+                    "New() must be passed one parameter per argument");
+      return std::unique_ptr<T>(
+          entry_ ? entry_->Create(PassArgument<Args>(
+                       std::forward<Params>(params))...)
+                 : nullptr);
+    }
+
+    bool IsStale() const {
+      return generation_ !=
+             Registry::generation_.load(std::memory_order_acquire);
+    }
+
+    // Resolve the key again. Return 'true' if the handle now refers to
+    // a different factory, e.g. because an injector shadows the key or
+    // went out of scope.
+    bool Refresh() {
+      const EntryRef previous = entry_;
+      *this = Resolve(key_);
+      return entry_.get() != previous.get();
+    }
+
+  private:
+    friend class Registry;
+    Factory(KeyView key, const EntryRef &entry, std::uint64_t generation)
+        : key_(key.ToString()), entry_(entry), generation_(generation) {}
+
+    std::string key_;
+    EntryRef entry_;
+    std::uint64_t generation_;
+  };
+
+  // Resolve the factory registered for `key` for a constructor with
+  // signature (Args... args). The returned handle is null if there is
+  // none.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  static Factory Resolve(KeyView key) {
+    // Read the generation first so that a concurrent change makes the
+    // handle stale rather than going unnoticed.
+    const std::uint64_t generation =
+        generation_.load(std::memory_order_acquire);
+    const EntryRef entry(key);
+    return Factory(key, entry, generation);
+  }
+
+  // Like Resolve(), but resolves all the keys in `keys`, e.g. a container
+  // of strings, from a single snapshot of the registry. The handles are in
+  // the same order as the keys, and those of missing keys are null.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  template <typename Keys>
+  static std::vector<Factory> ResolveAll(const Keys &keys) {
+    LoadRegistrations();
+    const Reclaimer::Pin pin;
+    std::vector<Factory> factories;
+    ResolveAll(keys, &factories, Locking());
+    return factories;
+  }
+  static std::vector<Factory> ResolveAll(std::initializer_list<KeyView> keys) {
+    return ResolveAll<std::initializer_list<KeyView>>(keys);
+  }
+
+  // Rebuild the index used by lookups into a minimal perfect hash over
+  // the keys known so far, so that a lookup is one hash and one key
+  // comparison. Meant to be called once registration is finished, e.g.
+  // at the beginning of main(). Registerers and injectors created later
+  // keep working, but each of them rebuilds the perfect hash. Only lookups
+  // under the default SnapshotLocking policy use the perfect hash.
+  static void Freeze() {
+    LoadRegistrations();
+    {
+      std::lock_guard<std::mutex> lock(registry_mutex_);
+      frozen_ = true;
+      Retire(snapshot_.exchange(nullptr, std::memory_order_acq_rel));
+    }
+    Reclaimer::Get()->Reclaim();
+    Publish();
+  }
+
+  // Return the key under which class `C` is registered. The header
+  // defining that class must be included by code calling this
+  // function. If class is not registered, there will be a compile-
+  // time failure.
+  template <typename C> static const char *GetKeyFor() {
+    return C::_xd_key(static_cast<const T *>(nullptr),
+                      std::function<void(Args...)>());
+  }
+
+  // Like New(GetKeyFor<C>(), params...), but constructing `C` directly,
+  // without any lookup nor indirect call, as long as no injector is
+  // alive: an injector may replace the class registered for the key, in
+  // which case the registry is used. As for GetKeyFor(), the header
+  // defining `C` must be included and `C` must be registered in this
+  // registry, or there will be a compile-time failure.
+  template <typename C, typename... Params, typename = IfConvertible<Params...>>
+  static std::unique_ptr<T> NewStatic(Params &&... params) {
+    static_assert(sizeof...(Params) == sizeof...(Args),
+                  "NewStatic() must be passed one parameter per argument");
+    if (HasInjectors()) {
+      return New(GetKeyFor<C>(), std::forward<Params>(params)...);
+    }
+    return std::unique_ptr<T>(
+        Construct<C>(PassArgument<Args>(std::forward<Params>(params))...));
+  }
+
+  // Returns the list of keys registered for the registry.
+  // Keys corresponding to injectors (see below) are suffixed with
+  // a star.
+  //
+  // This function can not be called from any static initializer
+  // or it creates initializer order fiasco.
+  static std::vector<std::string> GetKeys() {
+    LoadRegistrations();
+    std::vector<std::string> keys;
+    const KeysLock<Locking> lock;
+    for (const Entry *entry : GetSortedEntries(*GetRegistry())) {
+      keys.emplace_back(entry->key);
+    }
+    for (const Entry *entry : GetSortedEntries(*GetInjectors())) {
+      keys.emplace_back(entry->key + "*");
+    }
+    return keys;
+  }
+
+  // Like GetKeys() function, but also returns the filename
+  // and line number of the corresponding REGISTER() macros.
+  // For injectors, the filename and line number are those
+  // passed to the injector constructor.
+  static std::vector<std::string> GetKeysWithLocations() {
+    LoadRegistrations();
+    std::vector<std::string> keys;
+    const KeysLock<Locking> lock;
+    for (const Entry *entry : GetSortedEntries(*GetRegistry())) {
+      keys.emplace_back(std::string(entry->file) + ":" +
+                        std::string(entry->line) + ": " + entry->key);
+    }
+    for (const Entry *entry : GetSortedEntries(*GetInjectors())) {
+      keys.emplace_back(std::string(entry->file) + ":" +
+                        std::string(entry->line) + ": " + entry->key + "*");
+    }
+    return keys;
+  }
+
+  // Helper class which uses RAII to inject a factory which will be used
+  // instead of any class registered with the same key, for any call
+  // within the scope of the variable.
+  // If there are two injectors in the same scope for the same key,
+  // the last one takes precedence and cancels the first one, which will
+  // never be active, even if the second one gets out of scope.
+  //
+  // Creating or destroying an injector invalidates the snapshot used by
+  // lookups, so they should not be created in performance critical code.
+  struct Injector {
+    const std::string key;
+    Injector(const std::string &key,
+             const std::function<T *(Args...)> &function,
+             const char *file = "undefined", const char *line = "undefined")
+        : key(key),
+          entry_(std::make_shared<Injected>(key, file, line, function)) {
+      std::lock_guard<std::mutex> lock(registry_mutex_);
+      injector_count_.fetch_add(1, std::memory_order_release);
+      Insert(GetInjectors(), entry_.get(), Locking());
+      Invalidate();
+    }
+    ~Injector() {
+      {
+        std::lock_guard<std::mutex> lock(registry_mutex_);
+        Erase(GetInjectors(), key, Locking());
+        injector_count_.fetch_sub(1, std::memory_order_release);
+        Invalidate();
+      }
+      // Outside of the lock, as the destructors may use the registry. The
+      // function, and what it captured, is destroyed once no lookup still
+      // uses it, which is right away unless lookups run concurrently.
+      if (Shared *shared = entry_->shared.load(std::memory_order_acquire)) {
+        shared->Evict();
+      }
+      Reclaimer::Get()->Retire(std::move(entry_));
+      Reclaimer::Get()->Reclaim();
+    }
+
+  private:
+    std::shared_ptr<const Injected> entry_;
+  };
+  //***************************************************************************
+  // Implementation details that can't be made private because used in macros
+  //***************************************************************************
+  typedef std::function<T *(Args...)> function_t;
+  typedef T *(*creator_t)(Args &&...);
+
+  struct Registerer {
+    Registerer(creator_t creator, const ClassInfo *info,
+               const std::string &key, const char *file, const char *line) {
+      std::lock_guard<std::mutex> lock(registry_mutex_);
+      Insert(GetRegistry(), Retain(key, file, line, creator, info), Locking());
+      Invalidate();
+    }
+  };
+#ifdef REGISTERER_USE_SECTIONS
+  // What REGISTER() records for a class in the "registerer" section.
+  struct Registration {
+    const char *key;
+    const char *file;
+    const char *line;
+    creator_t creator;
+    const ClassInfo *info;
+  };
+  // Identifies the registry in section records by its address.
+  static const char section_id;
+#endif
+
+private:
+  struct Entry {
+    Entry(const std::string &key, const char *file, const char *line,
+          creator_t creator, const ClassInfo *info, const function_t *function)
+        : key(key), file(file), line(line), creator(creator), info(info),
+          function(function), pool(nullptr), shared(nullptr) {}
+
+    const std::string key;
+    const char *const file;
+    const char *const line;
+    // Classes registered with REGISTER() are created through a plain
+    // function pointer, which avoids the indirection of std::function.
+    // Only injectors, which may capture state, use `function`.
+    const creator_t creator;
+    // Null for injectors.
+    const ClassInfo *const info;
+    // Null for registered classes.
+    const function_t *const function;
+    // Created on demand by GetPool() and GetSharedSlot().
+    mutable std::atomic<Pool *> pool;
+    mutable std::atomic<Shared *> shared;
+
+    ~Entry() {
+      delete pool.load();
+      delete shared.load();
+    }
+
+    T *Create(Args &&... args) const {
+      return creator ? creator(std::forward<Args>(args)...)
+                     : (*function)(std::forward<Args>(args)...);
+    }
+  };
+  // Entry of an injector, which owns its function. It is owned by a
+  // std::shared_ptr<> so that lookups and Factory handles can keep it alive.
+  struct Injected : Entry, std::enable_shared_from_this<Injected> {
+    Injected(const std::string &key, const char *file, const char *line,
+             const function_t &function)
+        : Entry(key, file, line, nullptr, nullptr, &this->function_),
+          function_(function) {}
+
+  private:
+    const function_t function_;
+  };
+
+  // Idle memory blocks for one class, recycled by Pooled().
+  class Pool {
+  public:
+    explicit Pool(const ClassInfo *info)
+        : info_(info), capacity_(64), hits_(0), misses_(0) {}
+    ~Pool() { Trim(); }
+
+    const ClassInfo *info() const { return info_; }
+
+    void *Acquire() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!idle_.empty()) {
+          ++hits_;
+          void *block = idle_.back();
+          idle_.pop_back();
+          return block;
+        }
+        ++misses_;
+      }
+      return ::operator new(info_->size);
+    }
+
+    void Release(void *block) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() < capacity_) {
+          idle_.push_back(block);
+          return;
+        }
+      }
+      ::operator delete(block);
+    }
+
+    void SetCapacity(std::size_t capacity) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+      }
+      Trim(capacity);
+    }
+
+    // Free idle blocks beyond the first `keep` ones.
+    void Trim(std::size_t keep = 0) {
+      std::vector<void *> freed;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() > keep) {
+          freed.assign(idle_.begin() + keep, idle_.end());
+          idle_.resize(keep);
+        }
+      }
+      for (void *block : freed) {
+        ::operator delete(block);
+      }
+    }
+
+    PoolStats GetStats() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const PoolStats stats = {hits_, misses_, idle_.size(), capacity_};
+      return stats;
+    }
+
+  private:
+    const ClassInfo *const info_;
+    std::mutex mutex_;
+    std::vector<void *> idle_;
+    std::size_t capacity_;
+    std::size_t hits_;
+    std::size_t misses_;
+  };
+  // Instance returned by GetShared() for one entry. The mutex is only
+  // taken to construct the instance, reads load it atomically.
+  struct Shared {
+    std::mutex mutex;
+    std::shared_ptr<const T> instance;
+
+    bool Evict() {
+      std::shared_ptr<const T> previous =
+          std::atomic_exchange(&instance, std::shared_ptr<const T>());
+      return previous != nullptr;
+    }
+  };
+  // Object created by NewShared(), whose memory follows the control block
+  // in the same allocation. Erasing the class this way instantiates
+  // std::allocate_shared<>() once per registry rather than once per class.
+  struct SharedHolder {
+    SharedHolder() : object(nullptr) {}
+    ~SharedHolder() {
+      if (object) {
+        object->~T();
+      }
+    }
+    T *object;
+  };
+  // Allocator of the control block of a SharedHolder, reserving after it
+  // the memory for an instance of the class described by `info`, whose
+  // address is stored in `*storage`.
+  template <typename U> class SharedAllocator {
+  public:
+    typedef U value_type;
+    template <typename V> struct rebind { typedef SharedAllocator<V> other; };
+
+    SharedAllocator(const ResourceAllocator<char> &resource,
+                    const ClassInfo *info, void **storage)
+        : resource_(resource), info_(info), storage_(storage) {}
+    template <typename V>
+    SharedAllocator(const SharedAllocator<V> &other)
+        : resource_(other.resource_), info_(other.info_),
+          storage_(other.storage_) {}
+
+    U *allocate(std::size_t n) {
+      char *block = static_cast<char *>(
+          resource_.allocate_bytes(Offset(n) + info_->size, Alignment()));
+      *storage_ = block + Offset(n);
+      return reinterpret_cast<U *>(block);
+    }
+    void deallocate(U *block, std::size_t n) {
+      resource_.deallocate_bytes(block, Offset(n) + info_->size, Alignment());
+    }
+
+    template <typename V>
+    bool operator==(const SharedAllocator<V> &other) const {
+      return resource_ == other.resource_;
+    }
+    template <typename V>
+    bool operator!=(const SharedAllocator<V> &other) const {
+      return resource_ != other.resource_;
+    }
+
+  private:
+    template <typename V> friend class SharedAllocator;
+    std::size_t Alignment() const {
+      return std::max(std::alignment_of<U>::value, info_->alignment);
+    }
+    std::size_t Offset(std::size_t n) const {
+      return (n * sizeof(U) + info_->alignment - 1) / info_->alignment *
+             info_->alignment;
+    }
+
+    ResourceAllocator<char> resource_;
+    const ClassInfo *info_;
+    void **storage_;
+  };
+  // Construct an instance of the class described by `info` along with its
+  // control block, in memory taken from `resource`.
+  static std::shared_ptr<T> MakeShared(const ResourceAllocator<char> &resource,
+                                       const ClassInfo *info,
+                                       Args &&... args) {
+    void *storage = nullptr;
+    std::shared_ptr<SharedHolder> holder = std::allocate_shared<SharedHolder>(
+        SharedAllocator<SharedHolder>(resource, info, &storage));
+    holder->object = info->construct(storage, std::forward<Args>(args)...);
+    return std::shared_ptr<T>(holder, holder->object);
+  }
+  typedef HashIndex<Entry> EntryMap;
+  // Immutable view merging the registry and the injectors, the latter
+  // shadowing the former. Lookups only read the currently published
+  // snapshot, so they take no lock once registration is finished.
+  struct Snapshot {
+    EntryMap entries;
+    // Used instead of `entries` once the registry is frozen.
+    PerfectHashIndex<Entry> perfect;
+    bool frozen;
+  };
+  // Entry found for a key, which can be used as long as the reference is
+  // alive. The thread is only pinned during the lookup, not while the
+  // factory runs: entries of registered classes are never freed, and the
+  // entry of an injector is kept alive by the reference even if the
+  // injector is destroyed concurrently.
+  class EntryRef {
+  public:
+    EntryRef() : entry_(nullptr) {}
+    explicit EntryRef(KeyView key) : entry_(Load(key, &owner_)) {}
+
+    // Must be called with the thread pinned, as by the constructor.
+    void Reset(const Entry *entry) {
+      owner_.reset();
+      entry_ = Own(entry, &owner_);
+    }
+
+    const Entry *get() const { return entry_; }
+    const Entry *operator->() const { return entry_; }
+    explicit operator bool() const { return entry_ != nullptr; }
+
+  private:
+    // The key is passed by reference, as copying it to the stack for a call
+    // that is not inlined costs more than the lookup itself.
+    static const Entry *Load(const KeyView &key,
+                             std::shared_ptr<const Entry> *owner) {
+      const Reclaimer::Pin pin;
+      return Own(GetEntry(key), owner);
+    }
+    static const Entry *Own(const Entry *entry,
+                            std::shared_ptr<const Entry> *owner) {
+      if (entry && entry->function) {
+        *owner = static_cast<const Injected *>(entry)->shared_from_this();
+      }
+      return entry;
+    }
+
+    // Null for registered classes. Declared first, as Load() sets it.
+    std::shared_ptr<const Entry> owner_;
+    const Entry *entry_;
+  };
+  // The registry and injectors are created on demand using static variables
+  // inside a static method so that there is no order initialization fiasco.
+  static EntryMap *GetRegistry() {
+    static EntryMap registry;
+    return &registry;
+  }
+  static EntryMap *GetInjectors() {
+    static EntryMap injectors;
+    return &injectors;
+  };
+  // Entries of registered classes, which are never freed.
+  static std::deque<Entry> *GetRegistered() {
+    static std::deque<Entry> registered;
+    return &registered;
+  }
+  static std::mutex registry_mutex_;
+  // Whether Freeze() was called. Guarded by registry_mutex_.
+  static bool frozen_;
+  // Null whenever the registry or the injectors changed since the last
+  // snapshot was published. The next lookup then publishes a new one. The
+  // replaced snapshot is retired, to be freed once no lookup reads it.
+  static std::atomic<const Snapshot *> snapshot_;
+  // Like snapshot_, for the filter rejecting unknown keys.
+  static std::atomic<const KeyFilter *> filter_;
+  // Incremented whenever the registry or the injectors change.
+  static std::atomic<std::uint64_t> generation_;
+  // Number of Injector objects alive, incremented before an injector is
+  // indexed and decremented after it is removed, so that lookups can skip
+  // the injectors when it is zero.
+  static std::atomic<std::size_t> injector_count_;
+
+  // Must be called with registry_mutex_ held.
+  static const Entry *Retain(const std::string &key, const char *file,
+                             const char *line, creator_t creator,
+                             const ClassInfo *info) {
+    GetRegistered()->emplace_back(key, file, line, creator, info, nullptr);
+    return &GetRegistered()->back();
+  }
+
+  // Hand `object`, once unreachable by new lookups, to the Reclaimer. Must
+  // be called with registry_mutex_ held.
+  template <typename U> static void Retire(const U *object) {
+    if (object) {
+      Reclaimer::Get()->Retire(std::shared_ptr<const void>(object));
+    }
+  }
+
+  // Return the pool of the class of `entry`, or null if its objects can not
+  // be pooled: entries of injectors and over-aligned classes.
+  static Pool *GetPool(const Entry *entry) {
+    if (!entry || !entry->info ||
+        entry->info->alignment > std::alignment_of<std::max_align_t>::value) {
+      return nullptr;
+    }
+    Pool *pool = entry->pool.load(std::memory_order_acquire);
+    if (!pool) {
+      Pool *fresh = new Pool(entry->info);
+      if (entry->pool.compare_exchange_strong(pool, fresh,
+                                              std::memory_order_acq_rel)) {
+        pool = fresh;
+      } else {
+        delete fresh; // Another thread was first, `pool` is its pool.
+      }
+    }
+    return pool;
+  }
+
+  static Shared *GetSharedSlot(const Entry *entry) {
+    Shared *shared = entry->shared.load(std::memory_order_acquire);
+    if (!shared) {
+      Shared *fresh = new Shared;
+      if (entry->shared.compare_exchange_strong(shared, fresh,
+                                                std::memory_order_acq_rel)) {
+        shared = fresh;
+      } else {
+        delete fresh; // Another thread was first, `shared` is its slot.
+      }
+    }
+    return shared;
+  }
+
+  // Must be called with registry_mutex_ held.
+  static void Invalidate() {
+    Retire(snapshot_.exchange(nullptr, std::memory_order_acq_rel));
+    Retire(filter_.exchange(nullptr, std::memory_order_acq_rel));
+    generation_.fetch_add(1, std::memory_order_acq_rel);
+  }
+
+  static const Snapshot *Publish() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    const Snapshot *snapshot = snapshot_.load(std::memory_order_acquire);
+    if (!snapshot) {
+      std::unique_ptr<Snapshot> fresh(new Snapshot);
+      if (GetInjectors()->size() == 0) {
+        fresh->entries = *GetRegistry();
+      } else {
+        fresh->entries = *GetInjectors();
+        // Keys already copied from the injectors are left untouched.
+        GetRegistry()->ForEach(
+            [&fresh](const Entry &entry) { fresh->entries.Insert(&entry); });
+      }
+      fresh->frozen = false;
+      if (frozen_) {
+        std::vector<const Entry *> entries;
+        fresh->entries.ForEach(
+            [&entries](const Entry &entry) { entries.push_back(&entry); });
+        if (fresh->perfect.Build(entries)) {
+          fresh->frozen = true;
+          fresh->entries = EntryMap();
+        }
+      }
+      snapshot = fresh.release();
+      snapshot_.store(snapshot, std::memory_order_release);
+    }
+    return snapshot;
+  }
+
+  static const Snapshot *GetSnapshot() {
+    const Snapshot *snapshot = snapshot_.load(std::memory_order_acquire);
+    return snapshot ? snapshot : Publish();
+  }
+
+  static const Entry *Find(const Snapshot &snapshot, KeyView key,
+                           std::uint64_t hash) {
+    return snapshot.frozen ? snapshot.perfect.Find(key, hash)
+                           : snapshot.entries.Find(key, hash);
+  }
+
+  static const KeyFilter *PublishFilter() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    const KeyFilter *filter = filter_.load(std::memory_order_acquire);
+    if (!filter) {
+      std::unique_ptr<KeyFilter> fresh(
+          new KeyFilter(GetRegistry()->size() + GetInjectors()->size()));
+      const auto add = [&fresh](const Entry &entry) {
+        fresh->Add(HashKey(entry.key));
+      };
+      GetRegistry()->ForEach(add);
+      GetInjectors()->ForEach(add);
+      filter = fresh.release();
+      filter_.store(filter, std::memory_order_release);
+    }
+    return filter;
+  }
+
+#ifdef REGISTERER_USE_SECTIONS
+  // Add in bulk the classes recorded for this registry in the "registerer"
+  // section, the first time it is called. Must be called before any access
+  // to the registry, and without holding registry_mutex_.
+  static void LoadRegistrations() {
+    static const bool loaded = LoadSection();
+    (void)loaded;
+  }
+  static bool LoadSection() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    for (const SectionRecord *record = __start_registerer;
+         record != __stop_registerer; ++record) {
+      if (record->registry != &section_id) {
+        continue;
+      }
+      const Registration *registration =
+          static_cast<const Registration *>(record->registration);
+      Insert(GetRegistry(),
+             Retain(registration->key, registration->file, registration->line,
+                    registration->creator, registration->info),
+             Locking());
+    }
+    Invalidate();
+    return true;
+  }
+#else
+  // Classes are added by their Registerer during static initialization.
+  static void LoadRegistrations() {}
+#endif
+
+  // Must be called with the thread pinned, as by EntryRef.
+  static const Entry *GetEntry(KeyView key) {
+    LoadRegistrations();
+    return Lookup(key, HashKey(key), Locking());
+  }
+
+  //***************************************************************************
+  // Locking policies. Changes are made with registry_mutex_ held, and also
+  // take the lock of the policy, if any, when updating what lookups read.
+  //***************************************************************************
+  typedef typename LockingPolicy<T>::type Locking;
+
+  static const Entry *Lookup(KeyView key, std::uint64_t hash,
+                            SnapshotLocking) {
+    return Find(*GetSnapshot(), key, hash);
+  }
+  static void Insert(EntryMap *map, const Entry *entry, SnapshotLocking) {
+    map->Insert(entry);
+  }
+  static void Erase(EntryMap *map, KeyView key, SnapshotLocking) {
+    map->Erase(key);
+  }
+  template <typename Keys>
+  static void ResolveAll(const Keys &keys, std::vector<Factory> *factories,
+                         SnapshotLocking) {
+    const std::uint64_t generation =
+        generation_.load(std::memory_order_acquire);
+    const Snapshot &snapshot = *GetSnapshot();
+    for (const auto &key : keys) {
+      const KeyView view(key);
+      EntryRef entry;
+      entry.Reset(Find(snapshot, view, HashKey(view)));
+      factories->push_back(Factory(view, entry, generation));
+    }
+  }
+
+  // Same construction as the factories generated by REGISTER().
+  template <typename C> static T *Construct(Args &&... args) {
+    return new C(std::forward<Args>(args)...);
+  }
+
+  static bool HasInjectors() {
+    return injector_count_.load(std::memory_order_acquire) != 0;
+  }
+
+  static ReaderWriterMutex *GetReaderWriterMutex() {
+    static ReaderWriterMutex mutex;
+    return &mutex;
+  }
+  static const Entry *Lookup(KeyView key, std::uint64_t hash,
+                            ReaderWriterLocking) {
+    ReaderLock lock(*GetReaderWriterMutex());
+    const Entry *entry = HasInjectors() ? GetInjectors()->Find(key, hash)
+                                        : nullptr;
+    return entry ? entry : GetRegistry()->Find(key, hash);
+  }
+  static void Insert(EntryMap *map, const Entry *entry, ReaderWriterLocking) {
+    std::lock_guard<ReaderWriterMutex> lock(*GetReaderWriterMutex());
+    map->Insert(entry);
+  }
+  static void Erase(EntryMap *map, KeyView key, ReaderWriterLocking) {
+    std::lock_guard<ReaderWriterMutex> lock(*GetReaderWriterMutex());
+    map->Erase(key);
+  }
+
+  // Registered classes and injectors whose keys hash to the shard.
+  struct Shard {
+    std::mutex mutex;
+    EntryMap registry;
+    EntryMap injectors;
+  };
+  template <std::size_t N> static Shard *GetShard(std::uint64_t hash) {
+    static Shard shards[N];
+    return &shards[hash % N];
+  }
+  template <std::size_t N>
+  static const Entry *Lookup(KeyView key, std::uint64_t hash,
+                            ShardedLocking<N>) {
+    Shard *shard = GetShard<N>(hash);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    const Entry *entry =
+        HasInjectors() ? shard->injectors.Find(key, hash) : nullptr;
+    return entry ? entry : shard->registry.Find(key, hash);
+  }
+  template <std::size_t N>
+  static void Insert(EntryMap *map, const Entry *entry, ShardedLocking<N>) {
+    map->Insert(entry);
+    Shard *shard = GetShard<N>(HashKey(entry->key));
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    (map == GetInjectors() ? shard->injectors : shard->registry).Insert(entry);
+  }
+  template <std::size_t N>
+  static void Erase(EntryMap *map, KeyView key, ShardedLocking<N>) {
+    map->Erase(key);
+    Shard *shard = GetShard<N>(HashKey(key));
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    (map == GetInjectors() ? shard->injectors : shard->registry).Erase(key);
+  }
+
+  // A slot of the cache of CachedLocking<>, valid as long as the
+  // generation has not changed since `entry` was found.
+  struct CacheSlot {
+    std::uint64_t generation;
+    std::uint64_t hash;
+    const Entry *entry;
+  };
+  template <typename Policy, std::size_t Slots>
+  static const Entry *Lookup(KeyView key, std::uint64_t hash,
+                            CachedLocking<Policy, Slots>) {
+    // Trivial, so that it needs no guard against concurrent initialization.
+    static thread_local CacheSlot cache[Slots];
+    const std::uint64_t generation =
+        generation_.load(std::memory_order_acquire);
+    CacheSlot &slot = cache[hash % Slots];
+    if (slot.entry && slot.generation == generation && slot.hash == hash &&
+        KeyView(slot.entry->key) == key) {
+      return slot.entry;
+    }
+    const Entry *entry = Lookup(key, hash, Policy());
+    if (entry) {
+      slot.generation = generation;
+      slot.hash = hash;
+      slot.entry = entry;
+    }
+    return entry;
+  }
+  template <typename Policy, std::size_t Slots>
+  static void Insert(EntryMap *map, const Entry *entry,
+                     CachedLocking<Policy, Slots>) {
+    Insert(map, entry, Policy());
+  }
+  template <typename Policy, std::size_t Slots>
+  static void Erase(EntryMap *map, KeyView key,
+                    CachedLocking<Policy, Slots>) {
+    Erase(map, key, Policy());
+  }
+
+  template <typename Policy>
+  static const Entry *Lookup(KeyView key, std::uint64_t hash,
+                            FilteredLocking<Policy>) {
+    const KeyFilter *filter = filter_.load(std::memory_order_acquire);
+    if (!filter) {
+      filter = PublishFilter();
+    }
+    return filter->MayContain(hash) ? Lookup(key, hash, Policy()) : nullptr;
+  }
+  template <typename Policy>
+  static void Insert(EntryMap *map, const Entry *entry,
+                     FilteredLocking<Policy>) {
+    Insert(map, entry, Policy());
+  }
+  template <typename Policy>
+  static void Erase(EntryMap *map, KeyView key, FilteredLocking<Policy>) {
+    Erase(map, key, Policy());
+  }
+
+  // Without snapshots, keys are resolved one by one.
+  template <typename Keys, typename Policy>
+  static void ResolveAll(const Keys &keys, std::vector<Factory> *factories,
+                         Policy) {
+    for (const auto &key : keys) {
+      factories->push_back(Resolve(key));
+    }
+  }
+
+  // Held by GetKeys() while reading the registry and the injectors, which
+  // only changes with registry_mutex_ held, and with the reader-writer lock
+  // held exclusively under the ReaderWriterLocking policy.
+  template <typename Policy, typename = void> struct KeysLock {
+    KeysLock() : lock(registry_mutex_) {}
+    std::lock_guard<std::mutex> lock;
+  };
+  template <typename Dummy> struct KeysLock<ReaderWriterLocking, Dummy> {
+    KeysLock() : lock(*GetReaderWriterMutex()) {}
+    ReaderLock lock;
+  };
+  template <typename Policy, std::size_t Slots>
+  struct KeysLock<CachedLocking<Policy, Slots>> : KeysLock<Policy> {};
+  template <typename Policy>
+  struct KeysLock<FilteredLocking<Policy>> : KeysLock<Policy> {};
+
+  // Must be called with registry_mutex_ held.
+  static std::vector<const Entry *> GetSortedEntries(const EntryMap &map) {
+    std::vector<const Entry *> entries;
+    map.ForEach([&entries](const Entry &entry) { entries.push_back(&entry); });
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry *a, const Entry *b) { return a->key < b->key; });
+    return entries;
+  }
+};
+
+template <typename T, class... Args>
+std::mutex Registry<T, Args...>::registry_mutex_;
+
+template <typename T, class... Args> bool Registry<T, Args...>::frozen_ = false;
+
+template <typename T, class... Args>
+std::atomic<const typename Registry<T, Args...>::Snapshot *>
+    Registry<T, Args...>::snapshot_(nullptr);
+
+template <typename T, class... Args>
+std::atomic<const KeyFilter *> Registry<T, Args...>::filter_(nullptr);
+
+template <typename T, class... Args>
+std::atomic<std::uint64_t> Registry<T, Args...>::generation_(0);
+
+template <typename T, class... Args>
+std::atomic<std::size_t> Registry<T, Args...>::injector_count_(0);
+
+#ifdef REGISTERER_USE_SECTIONS
+template <typename T, class... Args>
+const char Registry<T, Args...>::section_id = 0;
+#endif
+
+// End of the recursion of TryNewAny() below.
+template <typename T> bool TryNewAny(KeyView, std::unique_ptr<T> *) {
+  return false;
+}
+
+// Try the constructor signatures bound with Registry<T, Args...>::With()
+// in order, creating an object with the first one for which a class is
+// registered for `key`. Return 'false' if there is none. For instance:
+//
+//   std::unique_ptr<Shape> shape;
+//   TryNewAny(key, &shape, Registry<Shape, const std::string &>::With(params),
+//             Registry<Shape>::With());
+template <typename T, typename Bound, typename... Rest>
+bool TryNewAny(KeyView key, std::unique_ptr<T> *result, Bound &&bound,
+               Rest &&... rest) {
+  return bound.TryNew(key, result) ||
+         TryNewAny(key, result, std::forward<Rest>(rest)...);
+}
+
+//*****************************************************************************
+// Implementation details of REGISTER() macro.
+//
+// Creates uniquely named traits class and functions which forces the
+// instantiation of a TypeRegisterer class with a static member doing the
+// actual registration in the registry. Note that TypeRegisterer being a
+// template, there is no violation of the One Definition Rule. The use of
+// Trait class is way to pass back information from the class where the
+// macro is called, to the definition of TypeRegisterer static member.
+// This works only because the Trait functions do not reference any other
+// static variable, or it would create an initialization order fiasco.
+//*****************************************************************************
+// Provides the ClassInfo::relocate function used to move Inline<> holders.
+// It is null for classes that can not be move constructed, which are then
+// never stored inline.
+template <typename base_type, typename derived_type,
+          bool = std::is_move_constructible<derived_type>::value>
+struct Relocator {
+  static base_type *Relocate(void *where, void *from) {
+    derived_type *source = static_cast<derived_type *>(from);
+    base_type *result = new (where) derived_type(std::move(*source));
+    source->~derived_type();
+    return result;
+  }
+  static constexpr base_type *(*Get())(void *, void *) { return &Relocate; }
+};
+
+template <typename base_type, typename derived_type>
+struct Relocator<base_type, derived_type, false> {
+  static constexpr base_type *(*Get())(void *, void *) { return nullptr; }
+};
+
+template <typename Trait, typename base_type, typename derived_type,
+          typename... Args>
+struct TypeRegisterer {
+  static base_type *Construct(void *where, Args &&... args) {
+    return new (where) derived_type(std::forward<Args>(args)...);
+  }
+  static const typename Registry<base_type, Args...>::ClassInfo info;
+  static const typename Registry<base_type, Args...>::Registerer instance;
+#ifdef REGISTERER_USE_SECTIONS
+  static base_type *Create(Args &&... args) {
+    return new derived_type(std::forward<Args>(args)...);
+  }
+  static constexpr typename Registry<base_type, Args...>::Registration
+      registration = {Trait::key(), Trait::file(), Trait::line(),
+                      &TypeRegisterer::Create, &info};
+#endif
+};
+
+template <typename Trait, typename base_type, typename derived_type,
+          typename... Args>
+const typename Registry<base_type, Args...>::ClassInfo
+    TypeRegisterer<Trait, base_type, derived_type, Args...>::info = {
+        sizeof(derived_type), std::alignment_of<derived_type>::value,
+        std::is_trivially_destructible<derived_type>::value,
+        &TypeRegisterer::Construct,
+        Relocator<base_type, derived_type>::Get()};
+
+template <typename Trait, typename base_type, typename derived_type,
+          typename... Args>
+const typename Registry<base_type, Args...>::Registerer 
+TypeRegisterer<Trait, base_type, derived_type, Args...>::instance(
+    [](Args &&... args) -> base_type * {
+      return new derived_type(std::forward<Args>(args)...);
+    },
+    &info, Trait::key(), Trait::file(), Trait::line());
+
+#ifdef REGISTERER_USE_SECTIONS
+template <typename Trait, typename base_type, typename derived_type,
+          typename... Args>
+constexpr typename Registry<base_type, Args...>::Registration
+    TypeRegisterer<Trait, base_type, derived_type, Args...>::registration;
+#endif
+
+#define CONCAT_TOKENS(x, y) x##y
+#define STRINGIFY(x) #x
+
+#ifdef REGISTERER_USE_SECTIONS
+// Instead of instantiating a Registerer, emit a constant record into the
+// "registerer" section from a function kept by the `used` attribute. The
+// record is written by the linker rather than during static initialization,
+// and the registry indexes all records of the section on first use. The
+// section attribute is ignored in templates, hence the record being a
+// local variable of the non-template class instead of a member of
+// TypeRegisterer.
+#define REGISTER_AT(LINE, KEY, TYPE, ARGS...)                                  \
+  friend class ::factory::Registry<TYPE, ##ARGS>;                              \
+  struct CONCAT_TOKENS(_xd_Trait, LINE) {                                      \
+    static constexpr const char *key() { return KEY; }                         \
+    static constexpr const char *file() { return __FILE__; }                   \
+    static constexpr const char *line() { return STRINGIFY(LINE); }            \
+  };                                                                           \
+  __attribute__((used)) const void *CONCAT_TOKENS(_xd_unused, LINE)() const {  \
+    typedef ::factory::TypeRegisterer<CONCAT_TOKENS(_xd_Trait, LINE), TYPE,    \
+                                      std::decay<decltype(*this)>::type,       \
+                                      ##ARGS> Registerer;                      \
+    static const ::factory::SectionRecord record                               \
+        __attribute__((section("registerer"),                                  \
+                       aligned(sizeof(::factory::SectionRecord)))) = {         \
+            &::factory::Registry<TYPE, ##ARGS>::section_id,                    \
+            &Registerer::registration};                                        \
+    return &record;                                                            \
+  }                                                                            \
+  static const char *_xd_key(const TYPE *, std::function<void(ARGS)>) {        \
+    return KEY;                                                                \
+  }                                                                            \
+  static_assert(true, "") // enforce ; at EOL
+#else
 #define REGISTER_AT(LINE, KEY, TYPE, ARGS...)                                  \
   friend class ::factory::Registry<TYPE, ##ARGS>;                              \
   struct CONCAT_TOKENS(_xd_Trait, LINE) {                                      \
@@ -419,6 +2877,7 @@ TypeRegisterer<Trait, base_type, derived_type, Args...>::instance(
     return KEY;                                                                \
   }                                                                            \
   static_assert(true, "") // enforce ; at EOL
+#endif
 
 } // namespace factory
 
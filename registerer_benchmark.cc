@@ -0,0 +1,323 @@
+// Micro-benchmarks of the registry. Benchmarks are themselves registered
+// classes: run without arguments to run them all, or pass the keys of
+// the benchmarks to run.
+#include "registerer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+using factory::Registry;
+
+// Count heap allocations, so that benchmarks can report them per operation.
+static std::atomic<long> allocations(0);
+
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *result = std::malloc(size ? size : 1)) {
+    return result;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+
+class Benchmark {
+public:
+  virtual ~Benchmark() {}
+  virtual void Run() = 0;
+};
+
+const int kIterations = 1000000;
+// Written with results of benchmarks so that they are not optimized away.
+volatile int sink;
+
+// Call `op` `iterations` times and print time and allocations per call.
+template <typename Op> void Report(const char *name, int iterations, Op op) {
+  const long allocations_before = allocations.load();
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    op();
+  }
+  const auto end = std::chrono::steady_clock::now();
+  const long allocations_after = allocations.load();
+  const double nanos =
+      std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << name << ": " << nanos / iterations << " ns/op, "
+            << double(allocations_after - allocations_before) / iterations
+            << " allocs/op\n";
+}
+
+//*****************************************************************************
+// Classes to instantiate.
+//*****************************************************************************
+class Shape {
+public:
+  virtual ~Shape() {}
+  virtual int sides() const = 0;
+};
+
+#define LONG_KEY "SquareWithAKeyTooLongForTheSmallStringOptimization"
+
+class Square : public Shape {
+  REGISTER(LONG_KEY, Shape);
+
+public:
+  int sides() const override { return 4; }
+};
+
+// One base class per locking policy.
+template <typename Policy> class Widget {
+public:
+  virtual ~Widget() {}
+};
+
+namespace factory {
+template <typename Policy> struct LockingPolicy<Widget<Policy>> {
+  typedef Policy type;
+};
+} // namespace factory
+
+class ReaderWriterGadget : public Widget<factory::ReaderWriterLocking> {
+  REGISTER(LONG_KEY, Widget<factory::ReaderWriterLocking>);
+};
+
+class ShardedGadget : public Widget<factory::ShardedLocking<16>> {
+  REGISTER(LONG_KEY, Widget<factory::ShardedLocking<16>>);
+};
+
+//*****************************************************************************
+// Benchmarks.
+//*****************************************************************************
+class KeyLookup : public Benchmark {
+  REGISTER("KeyLookup", Benchmark);
+
+public:
+  void Run() override {
+    const char *key = LONG_KEY;
+    // What callers holding a C string had to do before KeyView.
+    Report("New(std::string(const char *))", kIterations,
+           [key] { Registry<Shape>::New(std::string(key)); });
+    Report("New(const char *)", kIterations,
+           [key] { Registry<Shape>::New(key); });
+    Report("New(REGISTRY_KEY())", kIterations,
+           [] { Registry<Shape>::New(REGISTRY_KEY(LONG_KEY)); });
+  }
+};
+
+class CallPath : public Benchmark {
+  REGISTER("CallPath", Benchmark);
+
+public:
+  void Run() override {
+    const auto registered = Registry<Shape>::Resolve(LONG_KEY);
+    Report("Factory::New(), REGISTER() function pointer", kIterations,
+           [&registered] { registered.New(); });
+    Report("NewStatic<>()", kIterations,
+           [] { Registry<Shape>::NewStatic<Square>(); });
+    int sides = 4;
+    Registry<Shape>::Injector injector("Injected", [&sides]() -> Shape * {
+      return sides == 4 ? new Square : nullptr;
+    });
+    const auto injected = Registry<Shape>::Resolve("Injected");
+    Report("Factory::New(), Injector std::function", kIterations,
+           [&injected] { injected.New(); });
+  }
+};
+
+class Allocation : public Benchmark {
+  REGISTER("Allocation", Benchmark);
+
+public:
+  void Run() override {
+    Report("New()", kIterations, [] { Registry<Shape>::New(LONG_KEY); });
+    Report("NewInline<64>()", kIterations,
+           [] { Registry<Shape>::NewInline<64>(LONG_KEY); });
+    Report("Pooled()", kIterations, [] { Registry<Shape>::Pooled(LONG_KEY); });
+    Report("std::shared_ptr<>(New())", kIterations, [] {
+      std::shared_ptr<Shape>(Registry<Shape>::New(LONG_KEY));
+    });
+    Report("NewShared()", kIterations,
+           [] { Registry<Shape>::NewShared(LONG_KEY); });
+    alignas(16) char buffer[64];
+    Report("NewAt()", kIterations, [&buffer] {
+      Registry<Shape>::NewAt(buffer, sizeof(buffer), LONG_KEY)->~Shape();
+    });
+  }
+};
+
+class ManyObjects : public Benchmark {
+  REGISTER("ManyObjects", Benchmark);
+
+public:
+  void Run() override {
+    const int kCount = 10000;
+    const int kBatches = 200;
+    std::vector<std::unique_ptr<Shape>> shapes;
+    Report("10000 x New()", kBatches, [&shapes] {
+      shapes.clear();
+      for (int i = 0; i < kCount; ++i) {
+        shapes.push_back(Registry<Shape>::New(LONG_KEY));
+      }
+    });
+    Report("NewMany(10000)", kBatches,
+           [] { Registry<Shape>::NewMany(LONG_KEY, kCount); });
+    Report("NewSlab(10000)", kBatches,
+           [] { Registry<Shape>::NewSlab(LONG_KEY, kCount); });
+  }
+};
+
+class ManyKeys : public Benchmark {
+  REGISTER("ManyKeys", Benchmark);
+
+public:
+  void Run() override {
+    std::vector<std::unique_ptr<Registry<Shape>::Injector>> injectors;
+    std::vector<std::string> keys;
+    for (int i = 0; i < 5000; ++i) {
+      keys.push_back("Shape" + std::to_string(i));
+      injectors.emplace_back(new Registry<Shape>::Injector(
+          keys.back(), []() -> Shape * { return nullptr; }));
+    }
+    int i = 0;
+    Report("CanNew() among 5000 keys", kIterations,
+           [&] { Registry<Shape>::CanNew(keys[i++ % keys.size()]); });
+    Registry<Shape>::Freeze();
+    Report("CanNew() among 5000 keys, frozen", kIterations,
+           [&] { Registry<Shape>::CanNew(keys[i++ % keys.size()]); });
+  }
+};
+
+class InjectorProbe : public Benchmark {
+  REGISTER("InjectorProbe", Benchmark);
+
+public:
+  void Run() override {
+    Probe<factory::ReaderWriterLocking>("ReaderWriter");
+    Probe<factory::ShardedLocking<16>>("Sharded<16>");
+  }
+
+private:
+  // Look up a registered class with and without an unrelated injector.
+  template <typename Policy> static void Probe(const std::string &policy) {
+    typedef Registry<Widget<Policy>> Widgets;
+    Report((policy + ", no injector").c_str(), kIterations,
+           [] { Widgets::CanNew(LONG_KEY); });
+    typename Widgets::Injector injector(
+        "Unrelated", []() -> Widget<Policy> * { return nullptr; });
+    Report((policy + ", one injector").c_str(), kIterations,
+           [] { Widgets::CanNew(LONG_KEY); });
+  }
+};
+
+class Contention : public Benchmark {
+  REGISTER("Contention", Benchmark);
+
+public:
+  void Run() override {
+    Contend<factory::SnapshotLocking>("Snapshot");
+    Contend<factory::ReaderWriterLocking>("ReaderWriter");
+    Contend<factory::ShardedLocking<16>>("Sharded<16>");
+    Contend<factory::CachedLocking<factory::ReaderWriterLocking, 256>>(
+        "Cached<ReaderWriter, 256>");
+    Contend<factory::CachedLocking<factory::ShardedLocking<16>, 256>>(
+        "Cached<Sharded<16>, 256>");
+  }
+
+private:
+  // Look up 64 keys from several threads at once, and print the time per
+  // lookup, i.e. the inverse of the throughput of all threads together.
+  template <typename Policy> static void Contend(const std::string &policy) {
+    typedef Registry<Widget<Policy>> Widgets;
+    std::vector<std::unique_ptr<typename Widgets::Injector>> injectors;
+    std::vector<std::string> keys;
+    for (int i = 0; i < 64; ++i) {
+      keys.push_back("Widget" + std::to_string(i));
+      injectors.emplace_back(new typename Widgets::Injector(
+          keys.back(), []() -> Widget<Policy> * { return nullptr; }));
+    }
+    for (int threads : {1, 8, 32, 64}) {
+      const int lookups = kIterations / threads;
+      // Keeps the lookups from being optimized away.
+      std::atomic<int> found(0);
+      std::vector<std::thread> workers;
+      const auto start = std::chrono::steady_clock::now();
+      for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&keys, &found, lookups, t] {
+          int hits = 0;
+          for (int i = 0; i < lookups; ++i) {
+            hits += Widgets::CanNew(keys[(i + t) % keys.size()]);
+          }
+          found += hits;
+        });
+      }
+      for (auto &worker : workers) {
+        worker.join();
+      }
+      const auto end = std::chrono::steady_clock::now();
+      std::cout << policy << ", " << threads << " threads: "
+                << std::chrono::duration<double, std::nano>(end - start)
+                           .count() /
+                       (lookups * threads)
+                << " ns/lookup\n";
+    }
+  }
+};
+
+class NegativeLookup : public Benchmark {
+  REGISTER("NegativeLookup", Benchmark);
+
+public:
+  void Run() override {
+    MissRates<factory::SnapshotLocking>("Snapshot");
+    MissRates<factory::FilteredLocking<factory::SnapshotLocking>>(
+        "Filtered<Snapshot>");
+    MissRates<factory::ReaderWriterLocking>("ReaderWriter");
+    MissRates<factory::FilteredLocking<factory::ReaderWriterLocking>>(
+        "Filtered<ReaderWriter>");
+  }
+
+private:
+  // Look up keys among 1000 registered ones, a given percentage of which
+  // are not registered.
+  template <typename Policy> static void MissRates(const std::string &policy) {
+    typedef Registry<Widget<Policy>> Widgets;
+    std::vector<std::unique_ptr<typename Widgets::Injector>> injectors;
+    for (int i = 0; i < 1000; ++i) {
+      injectors.emplace_back(new typename Widgets::Injector(
+          "Widget" + std::to_string(i),
+          []() -> Widget<Policy> * { return nullptr; }));
+    }
+    for (int misses : {1, 50, 99}) {
+      std::vector<std::string> keys;
+      for (int i = 0; i < 1000; ++i) {
+        keys.push_back((i % 100 < misses ? "Unknown" : "Widget") +
+                       std::to_string(i));
+      }
+      int i = 0;
+      int hits = 0;
+      Report((policy + ", " + std::to_string(misses) + "% misses").c_str(),
+             kIterations, [&keys, &i, &hits] {
+               hits += Widgets::CanNew(keys[i++ % keys.size()]);
+             });
+      sink = hits;
+    }
+  }
+};
+
+int main(int argc, char **argv) {
+  for (const auto &key : Registry<Benchmark>::GetKeys()) {
+    if (argc > 1 && std::find(argv + 1, argv + argc, key) == argv + argc) {
+      continue;
+    }
+    std::cout << "== " << key << '\n';
+    Registry<Benchmark>::New(key)->Run();
+  }
+  return 0;
+}
@@ -43,10 +43,11 @@ int main(int argc, char **argv) {
   for (int i = 1; i + 1 < argc; i += 2) {
     const std::string key = argv[i];
     const std::string params = argv[i + 1];
-    if (Registry<Shape, const std::string &>::CanNew(key, params)) {
-      Registry<Shape, const std::string &>::New(key, params)->Draw();
-    } else if (Registry<Shape>::CanNew(key)) {
-      Registry<Shape>::New(key)->Draw();
+    std::unique_ptr<Shape> shape;
+    if (factory::TryNewAny(key, &shape,
+                           Registry<Shape, const std::string &>::With(params),
+                           Registry<Shape>::With())) {
+      shape->Draw();
     } else {
       std::cerr << "No '" << key << "' shape registered. Registered are\n";
       for (const auto &k : Registry<Shape>::GetKeys()) {
@@ -0,0 +1,104 @@
+// Startup cost of a large registry. The classes are generated by the
+// StartupBenchmark CMake module, enabled with the REGISTERER_STARTUP_BENCHMARK
+// option, which builds this file once per number of classes. Pass the path
+// of registerer_startup_0, which registers no class, to also report the
+// growth of the binary per registration. Sizes only count the segments
+// loaded in memory, i.e. code and data but not symbols or debug info.
+#include "registerer_startup_benchmark.h"
+
+#include <link.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using factory::Registry;
+
+namespace {
+// Set before the static initializers of the classes, which run with the
+// default priority, and statically initialized so that it is not reset.
+std::chrono::steady_clock::time_point init_start;
+
+__attribute__((constructor(101))) void StartInit() {
+  init_start = std::chrono::steady_clock::now();
+}
+
+double Micros(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+// Resident set size in KiB, or -1 if unknown.
+long ResidentKiB() {
+  std::ifstream status("/proc/self/status");
+  std::string field;
+  while (status >> field) {
+    if (field == "VmRSS:") {
+      long kib;
+      status >> kib;
+      return kib;
+    }
+  }
+  return -1;
+}
+
+// Total size in memory of the loadable segments of the ELF binary at
+// `path`, or -1 if it can not be read.
+long LoadableSize(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  ElfW(Ehdr) header;
+  if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      header.e_phentsize != sizeof(ElfW(Phdr))) {
+    return -1;
+  }
+  file.seekg(header.e_phoff);
+  long size = 0;
+  for (int i = 0; i < header.e_phnum; ++i) {
+    ElfW(Phdr) segment;
+    if (!file.read(reinterpret_cast<char *>(&segment), sizeof(segment))) {
+      return -1;
+    }
+    if (segment.p_type == PT_LOAD) {
+      size += static_cast<long>(segment.p_memsz);
+    }
+  }
+  return size;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  const auto init_end = std::chrono::steady_clock::now();
+  const long resident = ResidentKiB();
+  // The last class, registered by the last translation unit.
+  const std::string key =
+      "Class" + std::to_string(std::max(startup::kClasses - 1, 0));
+
+  auto start = std::chrono::steady_clock::now();
+  const bool found = Registry<startup::Plugin>::New(key) != nullptr;
+  const auto first = std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  Registry<startup::Plugin>::New(key);
+  const auto second = std::chrono::steady_clock::now() - start;
+
+  std::cout << startup::kClasses << " classes\n"
+            << "static initialization: " << Micros(init_end - init_start)
+            << " us\n"
+            << "resident memory after initialization: " << resident
+            << " KiB\n"
+            << "first lookup: " << Micros(first) << " us"
+            << (found || startup::kClasses == 0 ? "" : " (not found)") << '\n'
+            << "second lookup: " << Micros(second) << " us\n";
+  const long size = LoadableSize("/proc/self/exe");
+  std::cout << "loaded code and data: " << size << " bytes";
+  if (argc > 1 && startup::kClasses > 0) {
+    // std::max() keeps GCC from warning about a division by zero when
+    // building registerer_startup_0.
+    std::cout << ", "
+              << double(size - LoadableSize(argv[1])) /
+                     std::max(startup::kClasses, 1)
+              << " bytes/registration";
+  }
+  std::cout << '\n';
+  return 0;
+}
@@ -3,9 +3,17 @@
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
 using ::testing::UnorderedElementsAre;
 using ::testing::Return;
 
+using ::factory::KeyView;
 using ::factory::Registry;
 
 // Use a namespace to check that macros work inside another namespace.
@@ -109,7 +117,232 @@ TEST(Registry, Aliases) {
 
   EXPECT_THAT(Registry<Vehicle>::GetKeys(), ::testing::Contains("Bike*"));
   EXPECT_THAT(Registry<Vehicle>::GetKeysWithLocations(),
-              ::testing::Contains(this_file + ":102: Bike*"));
+              ::testing::Contains(this_file + ":110: Bike*"));
+}
+
+TEST(Registry, InjectorGoingOutOfScopeRestoresRegisteredClass) {
+  {
+    Registry<Engine>::Injector injector("V8", []() -> Engine * {
+      return nullptr;
+    });
+    EXPECT_FALSE(Registry<Engine>::New("V8").get());
+  }
+  auto engine = Registry<Engine>::New("V8");
+  ASSERT_TRUE(engine.get());
+  EXPECT_EQ(15, engine->consumption());
+}
+
+TEST(Registry, InjectorGoingOutOfScopeReleasesCapturedState) {
+  auto state = std::make_shared<int>(5);
+  {
+    Registry<Engine>::Injector injector("V8", [state]() -> Engine * {
+      return nullptr;
+    });
+    EXPECT_FALSE(Registry<Engine>::New("V8").get());
+    EXPECT_EQ(2, state.use_count());
+  }
+  EXPECT_EQ(1, state.use_count());
+}
+
+TEST(Registry, ResolvedFactoryKeepsInjectorAlive) {
+  auto state = std::make_shared<int>(5);
+  Registry<Engine>::Factory factory;
+  {
+    Registry<Engine>::Injector injector("V8", [state]() -> Engine * {
+      return nullptr;
+    });
+    factory = Registry<Engine>::Resolve("V8");
+  }
+  EXPECT_EQ(2, state.use_count());
+  EXPECT_FALSE(factory.New().get());
+  factory = Registry<Engine>::Factory();
+  EXPECT_EQ(1, state.use_count());
+}
+
+TEST(Registry, ConcurrentLookups) {
+  std::vector<std::thread> threads;
+  std::atomic<int> failures(0);
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&failures]() {
+      for (int j = 0; j < 1000; ++j) {
+        auto engine = Registry<Engine>::New(j % 2 ? "V4" : "V8");
+        if (!engine || engine->consumption() != (j % 2 ? 5 : 15)) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(0, failures);
+}
+
+TEST(Registry, ConcurrentLookupsWhileInjectorsComeAndGo) {
+  std::atomic<bool> done(false);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&done, &failures]() {
+      while (!done) {
+        // Either the registered V8 or the injected one, built from a V4.
+        auto engine = Registry<Engine>::New("V8");
+        if (!engine ||
+            (engine->consumption() != 15 && engine->consumption() != 5)) {
+          ++failures;
+        }
+        std::unique_ptr<Engine> injected;
+        if (Registry<Engine>::TryNew("V16", &injected) && !injected) {
+          ++failures;
+        }
+      }
+    });
+  }
+  // Captured by all injectors, which must release it once destroyed.
+  auto state = std::make_shared<int>(0);
+  {
+    // Destroyed once no thread looks up keys anymore, which frees it along
+    // with the injectors that lookups still held back when destroyed.
+    Registry<Engine>::Injector v12("V12", [state]() -> Engine * {
+      return Registry<Engine>::New("V8").release();
+    });
+    for (int i = 0; i < 200; ++i) {
+      Registry<Engine>::Injector v8("V8", [state]() -> Engine * {
+        return Registry<Engine>::New("V4").release();
+      });
+      Registry<Engine>::Injector v16("V16", [state]() -> Engine * {
+        return Registry<Engine>::New("V8").release();
+      });
+      std::this_thread::yield();
+    }
+    done = true;
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+  EXPECT_EQ(1, state.use_count());
+  EXPECT_EQ(0, failures);
+  EXPECT_EQ(15, Registry<Engine>::New("V8")->consumption());
+  EXPECT_FALSE(Registry<Engine>::CanNew("V16"));
+}
+
+TEST(Registry, ResolvedFactory) {
+  auto factory = Registry<Engine>::Resolve("V4");
+  ASSERT_TRUE(factory);
+  EXPECT_EQ("V4", factory.key());
+  EXPECT_FALSE(factory.IsStale());
+  auto engine = factory.New();
+  ASSERT_TRUE(engine.get());
+  EXPECT_EQ(5, engine->consumption());
+
+  EXPECT_FALSE(Registry<Engine>::Resolve("V16"));
+  EXPECT_FALSE(Registry<Engine>::Resolve("V16").New().get());
+}
+
+TEST(Registry, ResolvedFactoryNoticesInjectors) {
+  auto factory = Registry<Engine>::Resolve("V4");
+  {
+    Registry<Engine>::Injector injector("V4", []() -> Engine * {
+      return nullptr;
+    });
+    EXPECT_TRUE(factory.IsStale());
+    EXPECT_TRUE(factory.Refresh());
+    EXPECT_FALSE(factory.IsStale());
+    EXPECT_FALSE(factory.New().get());
+  }
+  EXPECT_TRUE(factory.IsStale());
+  EXPECT_TRUE(factory.Refresh());
+  auto engine = factory.New();
+  ASSERT_TRUE(engine.get());
+  EXPECT_EQ(5, engine->consumption());
+  EXPECT_FALSE(factory.Refresh());
+}
+
+TEST(Registry, ResolveAll) {
+  const std::vector<std::string> keys = {"V8", "V16", "V4"};
+  auto factories = Registry<Engine>::ResolveAll(keys);
+  ASSERT_EQ(3u, factories.size());
+  EXPECT_TRUE(factories[0]);
+  EXPECT_FALSE(factories[1]);
+  EXPECT_EQ("V16", factories[1].key());
+  EXPECT_EQ(5, factories[2].New()->consumption());
+
+  factories = Registry<Engine>::ResolveAll({"V4", "V8"});
+  ASSERT_EQ(2u, factories.size());
+  EXPECT_EQ(5, factories[0].New()->consumption());
+  EXPECT_EQ("V8", factories[1].key());
+}
+
+TEST(Registry, TryNew) {
+  std::unique_ptr<Engine> engine;
+  EXPECT_TRUE(Registry<Engine>::TryNew("V8", &engine));
+  ASSERT_TRUE(engine.get());
+  EXPECT_EQ(15, engine->consumption());
+  EXPECT_FALSE(Registry<Engine>::TryNew("V16", &engine));
+  EXPECT_TRUE(engine.get());
+
+  Registry<Engine>::Injector injector("V16", []() -> Engine * {
+    return nullptr;
+  });
+  EXPECT_TRUE(Registry<Engine>::TryNew("V16", &engine));
+  EXPECT_FALSE(engine.get());
+}
+
+TEST(Registry, TryNewAny) {
+  auto engine = Registry<Engine>::New("V8");
+  std::unique_ptr<Vehicle> vehicle;
+  EXPECT_TRUE(factory::TryNewAny(
+      "Truck", &vehicle, Registry<Vehicle, Engine *>::With(engine.get()),
+      Registry<Vehicle>::With()));
+  ASSERT_TRUE(vehicle.get());
+  EXPECT_EQ(engine.get(), vehicle->engine());
+
+  // "Bicycle" is only registered without parameters.
+  EXPECT_TRUE(factory::TryNewAny(
+      "Bicycle", &vehicle, Registry<Vehicle, Engine *>::With(engine.get()),
+      Registry<Vehicle>::With()));
+  ASSERT_TRUE(vehicle.get());
+  EXPECT_FALSE(vehicle->engine());
+
+  EXPECT_FALSE(factory::TryNewAny("Plane", &vehicle,
+                                  Registry<Vehicle>::With()));
+}
+
+TEST(Registry, LookupWithKeyView) {
+  const char buffer[] = "V4,V8";
+  EXPECT_TRUE(Registry<Engine>::CanNew(KeyView(buffer, 2)));
+  EXPECT_FALSE(Registry<Engine>::CanNew(KeyView(buffer, 1)));
+  EXPECT_FALSE(Registry<Engine>::CanNew(KeyView(buffer, 3)));
+  auto engine = Registry<Engine>::New(KeyView(buffer + 3, 2));
+  ASSERT_TRUE(engine.get());
+  EXPECT_EQ(15, engine->consumption());
+#if __cplusplus >= 201703L
+  EXPECT_TRUE(Registry<Engine>::CanNew(std::string_view(buffer, 2)));
+#endif
+}
+
+TEST(Registry, LookupWithCompileTimeKey) {
+  static_assert(REGISTRY_KEY("V8").size() == 2, "");
+  EXPECT_TRUE(REGISTRY_KEY("V8").has_hash());
+  EXPECT_EQ(factory::HashKey(std::string("V8")), REGISTRY_KEY("V8").hash());
+  EXPECT_EQ(factory::HashKey(std::string("\xe9t\xe9")),
+            REGISTRY_KEY("\xe9t\xe9").hash());
+  // Keys around the 8-byte words the hash processes.
+  EXPECT_EQ(factory::HashKey(std::string("")), REGISTRY_KEY("").hash());
+  EXPECT_EQ(factory::HashKey(std::string("1234567")),
+            REGISTRY_KEY("1234567").hash());
+  EXPECT_EQ(factory::HashKey(std::string("12345678")),
+            REGISTRY_KEY("12345678").hash());
+  EXPECT_EQ(factory::HashKey(std::string("123456789")),
+            REGISTRY_KEY("123456789").hash());
+  EXPECT_EQ(factory::HashKey(std::string("1234567890123456\xff")),
+            REGISTRY_KEY("1234567890123456\xff").hash());
+  EXPECT_NE(factory::HashKey(std::string("1234567")),
+            factory::HashKey(std::string("1234567\0", 8)));
+  auto engine = Registry<Engine>::New(REGISTRY_KEY("V8"));
+  ASSERT_TRUE(engine.get());
+  EXPECT_EQ(15, engine->consumption());
+  EXPECT_FALSE(Registry<Engine>::CanNew(REGISTRY_KEY("V6")));
 }
 
 //*****************************************************************************
@@ -156,5 +389,623 @@ TEST(RegisterMacro, WorksInHierarchies) {
   EXPECT_EQ(5, sub_derived->value());
 }
 
+TEST(RegisterMacro, NewStaticConstructsTheClass) {
+  EXPECT_STREQ("SubDerived", Registry<Base>::GetKeyFor<RegisteredSubDerived>());
+  auto sub_derived = Registry<Base>::NewStatic<RegisteredSubDerived>();
+  ASSERT_TRUE(sub_derived.get());
+  EXPECT_EQ(5, sub_derived->value());
+}
+
+TEST(RegisterMacro, NewStaticUsesInjectors) {
+  Registry<Base>::Injector injector("SubDerived",
+                                    []() { return new RegisteredDerived; });
+  auto injected = Registry<Base>::NewStatic<RegisteredSubDerived>();
+  ASSERT_TRUE(injected.get());
+  EXPECT_EQ(3, injected->value());
+}
+
+// Counts copies and moves of constructor arguments.
+struct Payload {
+  Payload() {}
+  Payload(const Payload &) { ++copies; }
+  Payload(Payload &&) { ++moves; }
+  static int copies;
+  static int moves;
+};
+int Payload::copies = 0;
+int Payload::moves = 0;
+
+class PayloadDerived : public Base {
+  REGISTER("Payload", Base, Payload);
+
+public:
+  explicit PayloadDerived(Payload) {}
+  int value() const override { return 7; }
+};
+
+class OwningDerived : public Base {
+  REGISTER("Owning", Base, std::unique_ptr<int>);
+
+public:
+  explicit OwningDerived(std::unique_ptr<int> value)
+      : value_(std::move(value)) {}
+  int value() const override { return *value_; }
+
+private:
+  const std::unique_ptr<int> value_;
+};
+
+TEST(NewArguments, AreMovedFromRvalues) {
+  Payload::copies = Payload::moves = 0;
+  ASSERT_TRUE((Registry<Base, Payload>::New("Payload", Payload()).get()));
+  EXPECT_EQ(0, Payload::copies);
+  EXPECT_EQ(1, Payload::moves);
+}
+
+TEST(NewArguments, AreCopiedOnceFromLvalues) {
+  Payload::copies = Payload::moves = 0;
+  const Payload payload;
+  ASSERT_TRUE((Registry<Base, Payload>::New("Payload", payload).get()));
+  EXPECT_EQ(1, Payload::copies);
+  EXPECT_EQ(1, Payload::moves);
+}
+
+TEST(NewArguments, ArePassedTheSameWayByNewStatic) {
+  Payload::copies = Payload::moves = 0;
+  const Payload payload;
+  ASSERT_TRUE(
+      (Registry<Base, Payload>::NewStatic<PayloadDerived>(payload).get()));
+  EXPECT_EQ(1, Payload::copies);
+  EXPECT_EQ(1, Payload::moves);
+}
+
+TEST(NewArguments, CanBeMoveOnly) {
+  std::unique_ptr<int> value(new int(9));
+  auto derived =
+      Registry<Base, std::unique_ptr<int>>::New("Owning", std::move(value));
+  ASSERT_TRUE(derived.get());
+  EXPECT_EQ(9, derived->value());
+
+  auto factory = Registry<Base, std::unique_ptr<int>>::Resolve("Owning");
+  derived = factory.New(std::unique_ptr<int>(new int(10)));
+  ASSERT_TRUE(derived.get());
+  EXPECT_EQ(10, derived->value());
+}
+
+// Bump allocator counting allocations and deallocations.
+class Arena {
+public:
+  Arena() : used_(0), allocations(0), deallocations(0) {}
+
+  void *allocate(std::size_t size, std::size_t alignment) {
+    used_ = (used_ + alignment - 1) / alignment * alignment;
+    if (used_ + size > sizeof(buffer_)) {
+      return nullptr;
+    }
+    ++allocations;
+    void *result = buffer_ + used_;
+    used_ += size;
+    return result;
+  }
+  void deallocate(void *, std::size_t, std::size_t) { ++deallocations; }
+
+  bool Contains(const void *pointer) const {
+    return buffer_ <= pointer && pointer < buffer_ + sizeof(buffer_);
+  }
+
+private:
+  alignas(16) char buffer_[256];
+  std::size_t used_;
+
+public:
+  int allocations;
+  int deallocations;
+};
+
+TEST(NewIn, ConstructsInResource) {
+  Arena arena;
+  auto engine = Registry<Engine>::New("V8");
+  auto vehicle =
+      Registry<Vehicle, Engine *>::NewIn(&arena, "Truck", engine.get());
+  ASSERT_TRUE(vehicle.get());
+  EXPECT_TRUE(arena.Contains(vehicle.get()));
+  EXPECT_EQ(140, vehicle->tank_size());
+  EXPECT_EQ(engine.get(), vehicle->engine());
+  EXPECT_EQ(1, arena.allocations);
+
+  vehicle.reset();
+  EXPECT_EQ(1, arena.deallocations);
+  EXPECT_FALSE(Registry<Engine>::NewIn(&arena, "V16").get());
+}
+
+TEST(NewIn, InjectedFactoriesUseTheHeap) {
+  Arena arena;
+  Registry<Engine>::Injector injector("V12", []() -> Engine * {
+    return Registry<Engine>::New("V8").release();
+  });
+  auto engine = Registry<Engine>::NewIn(&arena, "V12");
+  ASSERT_TRUE(engine.get());
+  EXPECT_FALSE(arena.Contains(engine.get()));
+  EXPECT_EQ(15, engine->consumption());
+  engine.reset();
+  EXPECT_EQ(0, arena.allocations);
+  EXPECT_EQ(0, arena.deallocations);
+}
+
+#if __cplusplus >= 201703L
+TEST(NewIn, AcceptsMemoryResources) {
+  char buffer[256];
+  std::pmr::monotonic_buffer_resource resource(buffer, sizeof(buffer));
+  auto engine = Registry<Engine>::NewIn(&resource, "V4");
+  ASSERT_TRUE(engine.get());
+  EXPECT_TRUE(buffer <= static_cast<void *>(engine.get()) &&
+              static_cast<void *>(engine.get()) < buffer + sizeof(buffer));
+  EXPECT_EQ(5, engine->consumption());
+}
+#endif
+
+struct Tag {};
+
+struct TrivialTag : public Tag {
+  REGISTER("Trivial", Tag);
+  double values[3];
+};
+
+TEST(GetClassInfo, DescribesRegisteredClasses) {
+  const auto *info = Registry<Base>::GetClassInfo("Derived");
+  ASSERT_TRUE(info);
+  EXPECT_EQ(sizeof(RegisteredDerived), info->size);
+  EXPECT_EQ(alignof(RegisteredDerived), info->alignment);
+  EXPECT_FALSE(info->trivially_destructible);
+
+  const auto *trivial = Registry<Tag>::GetClassInfo("Trivial");
+  ASSERT_TRUE(trivial);
+  EXPECT_EQ(sizeof(TrivialTag), trivial->size);
+  EXPECT_EQ(alignof(double), trivial->alignment);
+  EXPECT_TRUE(trivial->trivially_destructible);
+}
+
+TEST(GetClassInfo, IsNullForUnknownAndInjectedKeys) {
+  EXPECT_FALSE(Registry<Base>::GetClassInfo("Unknown"));
+  Registry<Base>::Injector injector("Injected", []() -> Base * {
+    return new UnregisteredDerived;
+  });
+  EXPECT_TRUE(Registry<Base>::CanNew("Injected"));
+  EXPECT_FALSE(Registry<Base>::GetClassInfo("Injected"));
+}
+
+TEST(NewAt, ConstructsInBuffer) {
+  alignas(RegisteredSubDerived) char buffer[2 * sizeof(RegisteredSubDerived)];
+  Base *derived = Registry<Base>::NewAt(buffer, sizeof(buffer), "SubDerived");
+  ASSERT_EQ(static_cast<void *>(buffer), static_cast<void *>(derived));
+  EXPECT_EQ(5, derived->value());
+  derived->~Base();
+}
+
+TEST(NewAt, FailsOnSmallOrMisalignedBuffers) {
+  alignas(RegisteredSubDerived) char buffer[2 * sizeof(RegisteredSubDerived)];
+  EXPECT_FALSE(Registry<Base>::NewAt(buffer, sizeof(RegisteredSubDerived) - 1,
+                                     "SubDerived"));
+  EXPECT_FALSE(
+      Registry<Base>::NewAt(buffer + 1, sizeof(buffer) - 1, "SubDerived"));
+  EXPECT_FALSE(Registry<Base>::NewAt(buffer, sizeof(buffer), "Unknown"));
+}
+
+TEST(NewInline, StoresSmallObjectsInline) {
+  auto derived = Registry<Base>::NewInline<64>("SubDerived");
+  ASSERT_TRUE(derived);
+  EXPECT_TRUE(derived.is_inline());
+  EXPECT_EQ(5, derived->value());
+
+  auto moved = std::move(derived);
+  EXPECT_FALSE(derived);
+  ASSERT_TRUE(moved);
+  EXPECT_TRUE(moved.is_inline());
+  EXPECT_EQ(5, moved->value());
+
+  EXPECT_FALSE(Registry<Base>::NewInline<64>("Unknown"));
+}
+
+TEST(NewInline, FallsBackToTheHeap) {
+  auto too_big = Registry<Base>::NewInline<1>("SubDerived");
+  ASSERT_TRUE(too_big);
+  EXPECT_FALSE(too_big.is_inline());
+  EXPECT_EQ(5, too_big->value());
+
+  // OwningDerived can not be moved because of its const member.
+  auto not_movable = Registry<Base, std::unique_ptr<int>>::NewInline<64>(
+      "Owning", std::unique_ptr<int>(new int(3)));
+  ASSERT_TRUE(not_movable);
+  EXPECT_FALSE(not_movable.is_inline());
+  auto moved = std::move(not_movable);
+  EXPECT_EQ(3, moved->value());
+}
+
+TEST(Pooled, RecyclesMemory) {
+  auto derived = Registry<Base>::Pooled("Derived");
+  ASSERT_TRUE(derived.get());
+  EXPECT_EQ(3, derived->value());
+  const void *address = derived.get();
+  derived.reset();
+
+  auto recycled = Registry<Base>::Pooled("Derived");
+  EXPECT_EQ(address, recycled.get());
+  auto other = Registry<Base>::Pooled("Derived");
+  EXPECT_NE(address, other.get());
+
+  auto stats = Registry<Base>::GetPoolStats("Derived");
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(2u, stats.misses);
+  EXPECT_EQ(0u, stats.idle);
+  EXPECT_EQ(64u, stats.capacity);
+
+  recycled.reset();
+  other.reset();
+  EXPECT_EQ(2u, Registry<Base>::GetPoolStats("Derived").idle);
+  EXPECT_TRUE(Registry<Base>::SetPoolCapacity("Derived", 1));
+  EXPECT_EQ(1u, Registry<Base>::GetPoolStats("Derived").idle);
+  Registry<Base>::TrimPool("Derived");
+  EXPECT_EQ(0u, Registry<Base>::GetPoolStats("Derived").idle);
+  EXPECT_EQ(1u, Registry<Base>::GetPoolStats("Derived").capacity);
+}
+
+TEST(Pooled, InjectedFactoriesAreNotPooled) {
+  Registry<Base>::Injector injector("Injected", []() -> Base * {
+    return new UnregisteredDerived;
+  });
+  auto derived = Registry<Base>::Pooled("Injected");
+  ASSERT_TRUE(derived.get());
+  EXPECT_EQ(3, derived->value());
+  EXPECT_FALSE(Registry<Base>::SetPoolCapacity("Injected", 10));
+  EXPECT_EQ(0u, Registry<Base>::GetPoolStats("Injected").misses);
+  EXPECT_FALSE(Registry<Base>::Pooled("Unknown").get());
+}
+
+// Counts instances, constructing them slowly to widen race windows.
+class CountedDerived : public Base {
+  REGISTER("Counted", Base, int);
+
+public:
+  explicit CountedDerived(int value) : value_(value) {
+    ++constructions;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  int value() const override { return value_; }
+  static std::atomic<int> constructions;
+
+private:
+  const int value_;
+};
+std::atomic<int> CountedDerived::constructions(0);
+
+TEST(NewArguments, AreConvertedImplicitly) {
+  const short value = 4;
+  auto derived = Registry<Base, int>::New("Counted", value);
+  ASSERT_TRUE(derived.get());
+  EXPECT_EQ(4, derived->value());
+  EXPECT_TRUE((Registry<Base, int>::CanNew("Counted", value)));
+}
+
+TEST(NewArguments, AcceptNullPointersAndBracedLists) {
+  auto truck = Registry<Vehicle, Engine *>::New("Truck", NULL);
+  ASSERT_TRUE(truck.get());
+  EXPECT_EQ(nullptr, truck->engine());
+  EXPECT_TRUE((Registry<Vehicle, Engine *>::New("Truck", 0).get()));
+  EXPECT_TRUE((Registry<Vehicle, Engine *>::CanNew("Truck", 0)));
+  auto derived = Registry<Base, int>::New("Counted", {4});
+  ASSERT_TRUE(derived.get());
+  EXPECT_EQ(4, derived->value());
+}
+
+TEST(GetShared, ConstructsOncePerKey) {
+  CountedDerived::constructions = 0;
+  std::vector<std::shared_ptr<const Base>> instances(8);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&instances, i] {
+      instances[i] = Registry<Base, int>::GetShared("Counted", i);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(1, CountedDerived::constructions);
+  for (const auto &instance : instances) {
+    ASSERT_TRUE(instance.get());
+    EXPECT_EQ(instances[0], instance);
+  }
+
+  // Later parameters are ignored until the instance is evicted.
+  const int value = instances[0]->value();
+  EXPECT_EQ(value, (Registry<Base, int>::GetShared("Counted", 42)->value()));
+  EXPECT_TRUE((Registry<Base, int>::EvictShared("Counted")));
+  EXPECT_FALSE((Registry<Base, int>::EvictShared("Counted")));
+  auto fresh = Registry<Base, int>::GetShared("Counted", 42);
+  EXPECT_EQ(42, fresh->value());
+  EXPECT_EQ(value, instances[0]->value());
+  EXPECT_EQ(2, CountedDerived::constructions);
+  EXPECT_FALSE((Registry<Base, int>::GetShared("Unknown", 0).get()));
+}
+
+TEST(GetShared, InjectorsHaveTheirOwnInstance) {
+  const auto registered = Registry<Base>::GetShared("Derived");
+  std::weak_ptr<const Base> injected;
+  {
+    Registry<Base>::Injector injector("Derived", []() -> Base * {
+      return new RegisteredSubDerived;
+    });
+    injected = Registry<Base>::GetShared("Derived");
+    ASSERT_FALSE(injected.expired());
+    EXPECT_EQ(5, injected.lock()->value());
+  }
+  EXPECT_TRUE(injected.expired());
+  EXPECT_EQ(registered, Registry<Base>::GetShared("Derived"));
+}
+
+TEST(NewShared, ConstructsSharedObjects) {
+  std::shared_ptr<Base> derived = Registry<Base>::NewShared("SubDerived");
+  ASSERT_TRUE(derived.get());
+  EXPECT_EQ(5, derived->value());
+  EXPECT_EQ(1, derived.use_count());
+  EXPECT_FALSE(Registry<Base>::NewShared("Unknown").get());
+
+  auto owning = Registry<Base, std::unique_ptr<int>>::NewShared(
+      "Owning", std::unique_ptr<int>(new int(4)));
+  ASSERT_TRUE(owning.get());
+  EXPECT_EQ(4, owning->value());
+}
+
+TEST(NewShared, AllocatesOnceFromResource) {
+  Arena arena;
+  auto engine = Registry<Engine>::New("V8");
+  auto vehicle =
+      Registry<Vehicle, Engine *>::NewSharedIn(&arena, "Truck", engine.get());
+  ASSERT_TRUE(vehicle.get());
+  EXPECT_TRUE(arena.Contains(vehicle.get()));
+  EXPECT_EQ(140, vehicle->tank_size());
+  EXPECT_EQ(1, arena.allocations);
+  vehicle.reset();
+  EXPECT_EQ(1, arena.deallocations);
+
+  Registry<Engine>::Injector injector("V12", []() -> Engine * {
+    return Registry<Engine>::New("V8").release();
+  });
+  auto injected = Registry<Engine>::NewSharedIn(&arena, "V12");
+  ASSERT_TRUE(injected.get());
+  EXPECT_FALSE(arena.Contains(injected.get()));
+  EXPECT_EQ(2, arena.allocations);
+}
+
+class Node : public std::enable_shared_from_this<Node> {
+public:
+  virtual ~Node() {}
+};
+
+class Leaf : public Node {
+  REGISTER("Leaf", Node);
+};
+
+TEST(NewShared, SetsUpSharedFromThis) {
+  std::shared_ptr<Node> leaf = Registry<Node>::NewShared("Leaf");
+  ASSERT_TRUE(leaf.get());
+  EXPECT_EQ(leaf, leaf->shared_from_this());
+
+  Arena arena;
+  auto other = Registry<Node>::NewSharedIn(&arena, "Leaf");
+  ASSERT_TRUE(other.get());
+  EXPECT_EQ(other, other->shared_from_this());
+  EXPECT_FALSE(arena.Contains(other.get()));
+}
+
+TEST(NewMany, ConstructsEachObject) {
+  auto engine = Registry<Engine>::New("V8");
+  auto vehicles =
+      Registry<Vehicle, Engine *>::NewMany("Truck", 3, engine.get());
+  ASSERT_EQ(3u, vehicles.size());
+  for (const auto &vehicle : vehicles) {
+    ASSERT_TRUE(vehicle.get());
+    EXPECT_EQ(engine.get(), vehicle->engine());
+  }
+  EXPECT_NE(vehicles[0], vehicles[1]);
+  EXPECT_TRUE(Registry<Base>::NewMany("Unknown", 3).empty());
+}
+
+TEST(NewMany, ConstructsInOneSlab) {
+  auto slab = Registry<Base>::NewSlab("SubDerived", 4);
+  ASSERT_EQ(4u, slab.size());
+  EXPECT_TRUE(slab.is_contiguous());
+  for (std::size_t i = 0; i < slab.size(); ++i) {
+    EXPECT_EQ(5, slab[i]->value());
+    EXPECT_EQ(reinterpret_cast<const char *>(slab[0]) +
+                  i * sizeof(RegisteredSubDerived),
+              reinterpret_cast<const char *>(slab[i]));
+  }
+  auto moved = std::move(slab);
+  EXPECT_TRUE(slab.empty());
+  EXPECT_EQ(4u, moved.size());
+
+  Registry<Base>::Injector injector("Injected", []() -> Base * {
+    return new UnregisteredDerived;
+  });
+  auto injected = Registry<Base>::NewSlab("Injected", 2);
+  ASSERT_EQ(2u, injected.size());
+  EXPECT_FALSE(injected.is_contiguous());
+  EXPECT_EQ(3, injected[1]->value());
+  EXPECT_TRUE(Registry<Base>::NewSlab("Unknown", 2).empty());
+}
+
+TEST(Registry, ManyKeysBeforeAndAfterFreeze) {
+  std::vector<std::unique_ptr<Registry<Base>::Injector>> injectors;
+  for (int i = 0; i < 1000; ++i) {
+    injectors.emplace_back(new Registry<Base>::Injector(
+        "Key" + std::to_string(i),
+        []() -> Base * { return new UnregisteredDerived; }));
+  }
+  // Remove some keys to exercise erasure in the middle of clusters.
+  for (int i = 0; i < 1000; i += 3) {
+    injectors[i].reset();
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < 1000; ++i) {
+      const std::string key = "Key" + std::to_string(i);
+      EXPECT_EQ(i % 3 != 0, Registry<Base>::CanNew(key)) << key;
+    }
+    EXPECT_TRUE(Registry<Base>::CanNew("Derived"));
+    EXPECT_FALSE(Registry<Base>::CanNew("Key1000"));
+    EXPECT_FALSE(Registry<Base>::CanNew(""));
+    Registry<Base>::Freeze();
+  }
+  injectors.clear();
+  EXPECT_FALSE(Registry<Base>::CanNew("Key1"));
+  EXPECT_TRUE(Registry<Base>::CanNew("SubDerived"));
+}
+
+
+// Base classes whose registries use the locking policies other than
+// the default one.
+class Sensor {
+public:
+  virtual ~Sensor() {}
+  virtual int value() const = 0;
+};
+
+class Relay {
+public:
+  virtual ~Relay() {}
+  virtual int value() const = 0;
+};
+
+class Gauge {
+public:
+  virtual ~Gauge() {}
+  virtual int value() const = 0;
+};
+
+class Valve {
+public:
+  virtual ~Valve() {}
+  virtual int value() const = 0;
+};
+
+} // namespace test
+} // namespace
+
+namespace factory {
+template <> struct LockingPolicy<test::Sensor> {
+  typedef ReaderWriterLocking type;
+};
+template <> struct LockingPolicy<test::Relay> {
+  typedef ShardedLocking<4> type;
+};
+template <> struct LockingPolicy<test::Gauge> {
+  typedef CachedLocking<ReaderWriterLocking, 4> type;
+};
+template <> struct LockingPolicy<test::Valve> {
+  typedef FilteredLocking<ShardedLocking<2>> type;
+};
+} // namespace factory
+
+namespace test {
+namespace {
+
+class Thermometer : public Sensor {
+  REGISTER("Probe", Sensor);
+
+public:
+  int value() const override { return 1; }
+};
+
+class Switch : public Relay {
+  REGISTER("Probe", Relay);
+
+public:
+  int value() const override { return 1; }
+};
+
+class Manometer : public Gauge {
+  REGISTER("Probe", Gauge);
+
+public:
+  int value() const override { return 1; }
+};
+
+class Faucet : public Valve {
+  REGISTER("Probe", Valve);
+
+public:
+  int value() const override { return 1; }
+};
+
+template <typename B> void CheckLockingPolicy() {
+  struct Injected : public B {
+    int value() const override { return 2; }
+  };
+  ASSERT_TRUE(Registry<B>::CanNew("Probe"));
+  EXPECT_EQ(1, Registry<B>::New("Probe")->value());
+  EXPECT_FALSE(Registry<B>::New("Unknown").get());
+  {
+    typename Registry<B>::Injector injector("Probe", []() -> B * {
+      return new Injected;
+    });
+    EXPECT_EQ(2, Registry<B>::New("Probe")->value());
+    EXPECT_THAT(Registry<B>::GetKeys(),
+                ::testing::ElementsAre("Probe", "Probe*"));
+    auto factories = Registry<B>::ResolveAll({"Probe", "Unknown"});
+    ASSERT_EQ(2u, factories.size());
+    EXPECT_EQ(2, factories[0].New()->value());
+    EXPECT_FALSE(factories[1]);
+  }
+  EXPECT_EQ(1, Registry<B>::New("Probe")->value());
+
+  std::atomic<bool> done(false);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&done, &failures]() {
+      while (!done) {
+        auto object = Registry<B>::New("Probe");
+        if (!object || (object->value() != 1 && object->value() != 2)) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 100; ++i) {
+    typename Registry<B>::Injector injector("Probe", []() -> B * {
+      return new Injected;
+    });
+    std::this_thread::yield();
+  }
+  done = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(0, failures);
+}
+
+TEST(LockingPolicy, ReaderWriter) { CheckLockingPolicy<Sensor>(); }
+
+TEST(LockingPolicy, Sharded) { CheckLockingPolicy<Relay>(); }
+
+TEST(LockingPolicy, Cached) { CheckLockingPolicy<Gauge>(); }
+
+TEST(LockingPolicy, Filtered) {
+  CheckLockingPolicy<Valve>();
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_FALSE(Registry<Valve>::CanNew("Unknown" + std::to_string(i)));
+  }
+}
+
+#ifdef REGISTERER_USE_SECTIONS
+// "V8" is registered in registerer_test_deps.cc, whose static initializers
+// run after those of this file.
+const bool v8_known_during_static_initialization =
+    Registry<Engine>::CanNew("V8");
+
+TEST(Registry, UsableDuringStaticInitializationWithSections) {
+  EXPECT_TRUE(v8_known_during_static_initialization);
+}
+#endif
+
 } // namespace test
 } // namespace